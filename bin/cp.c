@@ -25,9 +25,10 @@ typedef struct file_st
   enum ftype type;
   fs_t *fs;
   INODE ino;
-  size_t offset;
+  fs_file_t *handle;
+  uint64_t offset;
   FILE *file;
-  size_t size;
+  uint64_t size;
 } file_t;
 
 path_t *parse_path(const char *input)
@@ -119,10 +120,10 @@ void free_path(path_t *p)
 
 size_t iread(void *ptr, size_t size, size_t nitems, file_t *file)
 {
-  int ret = 0;
+  size_t ret = 0;
   if(file->type == ftype_image)
   {
-    ret = fs_read(file->fs, file->ino, ptr, size*nitems, file->offset);
+    ret = fs_pread(file->handle, ptr, size*nitems, file->offset);
     file->offset += ret;
   }
   if(file->type == ftype_native)
@@ -135,10 +136,10 @@ size_t iread(void *ptr, size_t size, size_t nitems, file_t *file)
 
 size_t iwrite(void *ptr, size_t size, size_t nitems, file_t *file)
 {
-  int ret = 0;
+  size_t ret = 0;
   if(file->type == ftype_image)
   {
-    ret = fs_write(file->fs, file->ino, ptr, size*nitems, file->offset);
+    ret = fs_pwrite(file->handle, ptr, size*nitems, file->offset);
     file->offset += ret;
   }
   if(file->type == ftype_native)
@@ -165,17 +166,18 @@ int main(int argc, const char *argv[])
   int retval = 0;
   path_t *src_path = 0;
   path_t *dst_path = 0;
-  file_t src_f = {0, 0, 0, 0, 0, 0};
-  file_t dst_f = {0, 0, 0, 0, 0, 0};
+  file_t src_f = {0, 0, 0, 0, 0, 0, 0};
+  file_t dst_f = {0, 0, 0, 0, 0, 0, 0};
   image_t *src_im = 0;
   image_t *dst_im = 0;
   partition_t *src_p = 0;
   partition_t *dst_p = 0;
   fs_t *src_fs = 0;
+  fs_options_t src_opt = {0, 0, 0, 64}; // Only read the metadata being copied
   fs_t *dst_fs = 0;
   void *buffer = 0;
   FILE *tmpf = 0;
-  fstat_t *st = 0;
+  fstat_t st;
 
   if(argc != 3)
   {
@@ -213,7 +215,7 @@ int main(int argc, const char *argv[])
       retval = 1;
       goto end;
     }
-    if(!(src_fs = fs_load(src_p, src_path->type)))
+    if(!(src_fs = fs_load_opt(src_p, src_path->type, &src_opt)))
     {
       fprintf(stderr, "%s: %s: Could not open source file system\n", argv[0], argv[1]);
       retval = 1;
@@ -268,7 +270,7 @@ int main(int argc, const char *argv[])
   }
 
   buffer = malloc(BUFFER_SIZE);
-  int readcount = 0;
+  size_t readcount = 0;
   if(src_path->type == std)
   {
     // If source is stdin
@@ -298,6 +300,7 @@ int main(int argc, const char *argv[])
     src_f.type = ftype_image;
     src_f.fs = src_fs;
     src_f.ino = fs_find(src_fs, src_path->path);
+    src_f.handle = fs_open(src_fs, src_f.ino);
     src_f.offset = 0;
   }
 
@@ -312,33 +315,38 @@ int main(int argc, const char *argv[])
     dst_f.fs = dst_fs;
     if(src_f.type == ftype_image)
     {
-      st = fs_fstat(src_f.fs, src_f.ino);
+      if(fs_fstat_r(src_f.fs, src_f.ino, &st))
+      {
+        fprintf(stderr, "%s: %s: Could not read source file\n", argv[0], argv[1]);
+        retval = 1;
+        goto end;
+      }
     } else {
       // Create new file in the image
-      st = malloc(sizeof(fstat_t));
       struct stat src_st;
       stat(src_path->path, &src_st);
-      st->size = src_st.st_size;
-      st->mode = S_CHR | S_RUSR | S_XGRP | S_WOTH;
-      if((src_st.st_mode & S_IFIFO) == S_IFIFO) st->mode = S_FIFO;
-      if((src_st.st_mode & S_IFCHR) == S_IFCHR) st->mode = S_CHR;
-      if((src_st.st_mode & S_IFDIR) == S_IFDIR) st->mode = S_DIR;
-      if((src_st.st_mode & S_IFBLK) == S_IFBLK) st->mode = S_BLK;
-      if((src_st.st_mode & S_IFREG) == S_IFREG) st->mode = S_REG;
-      if((src_st.st_mode & S_IFLNK) == S_IFLNK) st->mode = S_LINK;
-      if((src_st.st_mode & S_IFSOCK) == S_IFSOCK) st->mode = S_SOCK;
-      st->mode |= src_st.st_mode & 0777;
+      st.size = src_st.st_size;
+      st.mode = S_CHR | S_RUSR | S_XGRP | S_WOTH;
+      if((src_st.st_mode & S_IFIFO) == S_IFIFO) st.mode = S_FIFO;
+      if((src_st.st_mode & S_IFCHR) == S_IFCHR) st.mode = S_CHR;
+      if((src_st.st_mode & S_IFDIR) == S_IFDIR) st.mode = S_DIR;
+      if((src_st.st_mode & S_IFBLK) == S_IFBLK) st.mode = S_BLK;
+      if((src_st.st_mode & S_IFREG) == S_IFREG) st.mode = S_REG;
+      if((src_st.st_mode & S_IFLNK) == S_IFLNK) st.mode = S_LINK;
+      if((src_st.st_mode & S_IFSOCK) == S_IFSOCK) st.mode = S_SOCK;
+      st.mode |= src_st.st_mode & 0777;
     #ifdef __APPLE__
-      st->atime = src_st.st_atimespec.tv_sec;
-      st->ctime = src_st.st_ctimespec.tv_sec;
-      st->mtime = src_st.st_mtimespec.tv_sec;
+      st.atime = src_st.st_atimespec.tv_sec;
+      st.ctime = src_st.st_ctimespec.tv_sec;
+      st.mtime = src_st.st_mtimespec.tv_sec;
     #else
-      st->atime = src_st.st_atime;
-      st->ctime = src_st.st_ctime;
-      st->mtime = src_st.st_mtime;
+      st.atime = src_st.st_atime;
+      st.ctime = src_st.st_ctime;
+      st.mtime = src_st.st_mtime;
     #endif
     }
-    dst_f.ino = fs_touchp(dst_fs, st, dst_path->path);
+    dst_f.ino = fs_touchp(dst_fs, &st, dst_path->path);
+    dst_f.handle = fs_open(dst_fs, dst_f.ino);
   }
 
 
@@ -351,13 +359,27 @@ int main(int argc, const char *argv[])
     printf(" Source: %d %s %d %s\n", src_path->type, src_path->image, src_path->partition, src_path->path);
 
 
-  while((readcount = iread(buffer, 1, BUFFER_SIZE, &src_f)))
+  if(src_f.type == ftype_image && dst_f.type == ftype_image)
   {
-    iwrite(buffer, 1, readcount, &dst_f);
+    // Both files are in images, copy directly between the image files
+    if(fs_copy_range(src_f.fs, src_f.ino, dst_f.fs, dst_f.ino, 0, 0, st.size) != st.size)
+    {
+      fprintf(stderr, "%s: %s: Could not copy file\n", argv[0], argv[2]);
+      retval = 1;
+    }
+  } else {
+    while((readcount = iread(buffer, 1, BUFFER_SIZE, &src_f)))
+    {
+      iwrite(buffer, 1, readcount, &dst_f);
+    }
   }
 
 
 end:
+  if(src_f.handle)
+    fs_close_file(src_f.handle);
+  if(dst_f.handle)
+    fs_close_file(dst_f.handle);
   if(src_f.type == ftype_native && src_f.file)
     fclose(src_f.file);
   if(dst_f.type == ftype_native && dst_f.file)
@@ -383,8 +405,6 @@ end:
     free_path(dst_path);
   if(buffer)
     free(buffer);
-  if(st)
-    free(st);
 
   return retval;
 }
@@ -124,13 +124,13 @@ int main(int argc, const char *argv[])
 
   unsigned int i;
   buffer = malloc(512);
-  fseek(im->file, 512*mbr->start_LBA, SEEK_SET);
+  fseeko(im->file, (off_t)512*mbr->start_LBA, SEEK_SET);
   for(i = 0; i < mbr->num_sectors; i++)
   {
     int readcount = fread(buffer, 1, 512, im->file);
     fwrite(buffer, 1, readcount, output);
   }
-  printf("Extracted %d disk sectors (%d bytes) of partition %d.\n", i, i*512, path->partition+1);
+  printf("Extracted %u disk sectors (%llu bytes) of partition %d.\n", i, (unsigned long long)i*512, path->partition+1);
 
   retval = 0;
 
@@ -83,7 +83,7 @@ void free_path(path_t *p)
 
 void usage(const char *argv[])
 {
-  printf("usage: %s image:partition format\n", argv[0]);
+  printf("usage: %s [-b block_size] [-i inode_ratio] [-m reserved_percent] image:partition format\n", argv[0]);
 }
 
 int main(int argc, const char *argv[])
@@ -93,45 +93,94 @@ int main(int argc, const char *argv[])
   image_t *im = 0;
   partition_t *p = 0;
   fs_t *fs = 0;
+  fs_options_t opt = {0, 0, 0, 0};
 
-  if(argc != 3)
+  // Parse options
+  int i = 1;
+  while(i < argc && argv[i][0] == '-')
+  {
+    if(i + 1 >= argc)
+    {
+      usage(argv);
+      retval = 1;
+      goto end;
+    }
+    if(!strcmp(argv[i], "-b"))
+    {
+      opt.block_size = strtoul(argv[i+1], 0, 0);
+    } else if(!strcmp(argv[i], "-i")) {
+      opt.inode_ratio = strtoul(argv[i+1], 0, 0);
+    } else if(!strcmp(argv[i], "-m")) {
+      opt.reserved = strtoul(argv[i+1], 0, 0);
+    } else {
+      usage(argv);
+      retval = 1;
+      goto end;
+    }
+    i += 2;
+  }
+  if(opt.reserved > 50)
+  {
+    fprintf(stderr, "%s: Reserved blocks percentage must be at most 50\n", argv[0]);
+    retval = 1;
+    goto end;
+  }
+
+  if(argc - i != 2)
   {
     usage(argv);
     retval = 1;
     goto end;
   }
 
-  path = parse_path(argv[1]);
+  if(!strcmp(argv[i+1], "fat"))
+  {
+    // Block size is the cluster size
+    if(opt.block_size && (opt.block_size < 512 || opt.block_size > 32768 \
+          || (opt.block_size & (opt.block_size - 1))))
+    {
+      fprintf(stderr, "%s: Cluster size must be a power of two from 512 to 32768\n", argv[0]);
+      retval = 1;
+      goto end;
+    }
+  } else if(opt.block_size && opt.block_size != 1024 && opt.block_size != 2048 && opt.block_size != 4096) {
+    fprintf(stderr, "%s: Block size must be 1024, 2048 or 4096\n", argv[0]);
+    retval = 1;
+    goto end;
+  }
+
+  path = parse_path(argv[i]);
   if(!path)
   {
-    fprintf(stderr, "%s: %s: Invalid path\n", argv[0], argv[1]);
+    fprintf(stderr, "%s: %s: Invalid path\n", argv[0], argv[i]);
     usage(argv);
     retval = 1;
     goto end;
   }
   if(!(im = image_load(path->image)))
   {
-    fprintf(stderr, "%s: %s: Could not open source image file\n", argv[0], argv[1]);
+    fprintf(stderr, "%s: %s: Could not open source image file\n", argv[0], argv[i]);
     retval = 1;
     goto end;
   }
   if(!(p = partition_open(im, path->partition)))
   {
-    fprintf(stderr, "%s: %s: Could not open source image file\n", argv[0], argv[1]);
+    fprintf(stderr, "%s: %s: Could not open source image file\n", argv[0], argv[i]);
     retval = 1;
     goto end;
   }
 
-  if(!strcmp(argv[2], "ext2")) path->type = ext2;
-  else if(!strcmp(argv[2], "fat")) path->type = fat;
-  else if(!strcmp(argv[2], "sfs")) path->type = sfs;
-  else if(!strcmp(argv[2], "ntfs")) path->type = ntfs;
-  else if(!strcmp(argv[2], "hfs")) path->type = hfs;
+  const char *format = argv[i+1];
+  if(!strcmp(format, "ext2")) path->type = ext2;
+  else if(!strcmp(format, "fat")) path->type = fat;
+  else if(!strcmp(format, "sfs")) path->type = sfs;
+  else if(!strcmp(format, "ntfs")) path->type = ntfs;
+  else if(!strcmp(format, "hfs")) path->type = hfs;
   else path->type = unknown;
 
-  if(!(fs = fs_create(p, path->type)))
+  if(!(fs = fs_create(p, path->type, &opt)))
   {
-    fprintf(stderr, "%s: Could not create filesystem %s\n", argv[0], argv[2]);
+    fprintf(stderr, "%s: Could not create filesystem %s\n", argv[0], format);
     retval = 1;
     goto end;
   }
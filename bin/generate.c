@@ -12,7 +12,7 @@ void usage(const char *argv[])
 
 size_t parse_size(const char *size)
 {
-  size_t bytes = atoi(size);
+  size_t bytes = strtoull(size, 0, 10);
   switch(size[strlen(size)-1])
   {
     case 'G':
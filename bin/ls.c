@@ -114,8 +114,12 @@ int main(int argc, const char *argv[])
   image_t *im = 0;
   partition_t *p = 0;
   fs_t *fs = 0;
-  dirent_t *de = 0;
-  fstat_t *st = 0;
+  fs_options_t opt = {0, 0, 0, 64}; // Only read the metadata being listed
+  dirent_t de;
+  char name[FS_NAME_MAX];
+  fstat_t st;
+  fs_arena_t arena;
+  fs_arena_init(&arena, 0);
 
   if(argc < 2 || argc > 3)
   {
@@ -159,7 +163,7 @@ int main(int argc, const char *argv[])
     retval = 1;
     goto end;
   }
-  if(!(fs = fs_load(p, path->type)))
+  if(!(fs = fs_load_opt(p, path->type, &opt)))
   {
     fprintf(stderr, "%s: %s: Could not load filesystem\n", argv[0], pth);
     retval = 1;
@@ -175,50 +179,55 @@ int main(int argc, const char *argv[])
     retval = 1;
     goto end;
   }
-  st = fs_fstat(fs, dir);
-  if((st->mode & S_DIR) != S_DIR)
+  if(fs_fstat_r(fs, dir, &st) || (st.mode & S_DIR) != S_DIR)
   {
     fprintf(stderr, "%s: %s: Not a directory\n", argv[0], path->path);
     retval = 1;
     goto end;
   }
-  free(st);
   int i = 0;
-  while((de = fs_readdir(fs, dir, i)))
+  if(detailed)
   {
-    if(detailed)
+    // Get the entries together with their stats, a batch at a time
+    direntplus_t entries[32];
+    unsigned int n, k;
+    while((n = fs_readdirplus(fs, dir, i, entries, 32, &arena)))
     {
-      st = fs_fstat(fs, de->ino);
-      printf("%c%c%c%c%c%c%c%c%c%c", \
-          ((st->mode & S_DIR) == S_DIR)?'d':'-', \
-          ((st->mode & S_RUSR) == S_RUSR)?'r':'-', \
-          ((st->mode & S_WUSR) == S_WUSR)?'w':'-', \
-          ((st->mode & S_XUSR) == S_XUSR)?'x':'-', \
-          ((st->mode & S_RGRP) == S_RGRP)?'r':'-', \
-          ((st->mode & S_WGRP) == S_WGRP)?'w':'-', \
-          ((st->mode & S_XGRP) == S_XGRP)?'x':'-', \
-          ((st->mode & S_ROTH) == S_ROTH)?'r':'-', \
-          ((st->mode & S_WOTH) == S_WOTH)?'w':'-', \
-          ((st->mode & S_XOTH) == S_XOTH)?'x':'-');
-      time_t mtime = st->mtime;
-      char buffer[25];
-      strftime(buffer, 25, "%d %b %H:%M", gmtime(&mtime));
-      printf("\t %ld \t %s \t %s\n", st->size, buffer, de->name);
-      free(st);
-    } else {
-      printf("%s \t", de->name);
+      for(k = 0; k < n; k++)
+      {
+        fstat_t *est = &entries[k].st;
+        printf("%c%c%c%c%c%c%c%c%c%c", \
+            ((est->mode & S_DIR) == S_DIR)?'d':'-', \
+            ((est->mode & S_RUSR) == S_RUSR)?'r':'-', \
+            ((est->mode & S_WUSR) == S_WUSR)?'w':'-', \
+            ((est->mode & S_XUSR) == S_XUSR)?'x':'-', \
+            ((est->mode & S_RGRP) == S_RGRP)?'r':'-', \
+            ((est->mode & S_WGRP) == S_WGRP)?'w':'-', \
+            ((est->mode & S_XGRP) == S_XGRP)?'x':'-', \
+            ((est->mode & S_ROTH) == S_ROTH)?'r':'-', \
+            ((est->mode & S_WOTH) == S_WOTH)?'w':'-', \
+            ((est->mode & S_XOTH) == S_XOTH)?'x':'-');
+        time_t mtime = est->mtime;
+        char buffer[25];
+        strftime(buffer, 25, "%d %b %H:%M", gmtime(&mtime));
+        printf("\t %llu \t %s \t %s\n", (unsigned long long)est->size, buffer, entries[k].name);
+      }
+      i += n;
+      fs_arena_reset(&arena);
+    }
+  } else {
+    while(!fs_readdir_r(fs, dir, i, &de, name, FS_NAME_MAX))
+    {
+      printf("%s \t", de.name);
+      i++;
     }
-    i++;
-    free(de->name);
-    free(de);
+    printf("\n");
   }
-  if(!detailed) printf("\n");
 
   retval = 0;
 
 end:
-  if(st)
-    free(st);
+  fs_arena_free(&arena);
   if(fs)
     fs_close(fs);
   if(p)
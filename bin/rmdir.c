@@ -127,8 +127,9 @@ int main(int argc, const char *argv[])
   partition_t *p = 0;
   fs_t *fs = 0;
   char *pth = 0;
-  dirent_t *de = 0;
-  fstat_t *st = 0;
+  dirent_t de;
+  char name[FS_NAME_MAX];
+  fstat_t st;
 
   if(argc != 2)
   {
@@ -164,21 +165,21 @@ int main(int argc, const char *argv[])
   }
 
   INODE target = fs_find(fs, path->path);
-  if(!(st = fs_fstat(fs, target)))
+  if(fs_fstat_r(fs, target, &st))
   {
     fprintf(stderr, "%s: %s: Fstat failed\n", argv[0], path->path);
     retval = 1;
     goto end;
   }
 
-  if((st->mode & S_DIR) != S_DIR)
+  if((st.mode & S_DIR) != S_DIR)
   {
     fprintf(stderr, "%s: %s is not a directory\n", argv[0], path->path);
     retval = 1;
     goto end;
   }
 
-  if(fs_readdir(fs, target, 2))
+  if(!fs_readdir_r(fs, target, 2, &de, name, FS_NAME_MAX))
   {
     fprintf(stderr, "%s: %s is not empty\n", argv[0], path->path);
     retval = 1;
@@ -194,17 +195,14 @@ int main(int argc, const char *argv[])
   int num = 0;
   while(1)
   {
-    de = fs_readdir(fs, parent, num);
-    if(!de)
+    if(fs_readdir_r(fs, parent, num, &de, name, FS_NAME_MAX))
     {
       fprintf(stderr, "%s: Path not found\n", argv[0]);
       retval = 1;
       goto end;
     }
-    if(!strcmp(&c[1], de->name))
+    if(!strcmp(&c[1], de.name))
       break;
-    free(de->name);
-    free(de);
     num++;
   }
 
@@ -213,8 +211,6 @@ int main(int argc, const char *argv[])
 
 
 end:
-  if(st)
-    free(st);
   if(fs)
     fs_close(fs);
   if(p)
@@ -225,10 +221,5 @@ end:
     free_path(path);
   if(pth)
     free(pth);
-  if(de)
-  {
-    free(de->name);
-    free(de);
-  }
   return retval;
 }
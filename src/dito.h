@@ -38,8 +38,8 @@ typedef struct
 {
   image_t *im;
   int partition;
-  size_t offset;
-  size_t length;
+  uint64_t offset;
+  uint64_t length;
 } partition_t;
 
 partition_t *partition_open(image_t *im, int partition);
@@ -73,12 +73,54 @@ typedef struct
 
 typedef struct
 {
-  size_t size;
+  uint64_t size;
   uint32_t mode;
   uint32_t atime;
   uint32_t ctime;
   uint32_t mtime;
 }fstat_t;
+
+typedef struct
+{
+  INODE ino;
+  char *name;
+  fstat_t st;
+} direntplus_t;
+
+// A run of file data that is contiguous in the image file, as returned
+// by fs_fiemap(). Offsets and length are in bytes, and runs cover whole
+// blocks or clusters, so the last one may reach past the end of the file.
+typedef struct
+{
+  uint64_t logical; // Offset in the file
+  uint64_t physical; // Offset in the image file
+  uint64_t length;
+} fs_extent_t;
+
+#define FS_NAME_MAX 256 // Name buffer size that fits any file name
+
+// Memory for results that outlive a call, like the names from
+// fs_readdirplus(). Everything is freed at once by fs_arena_reset() or
+// fs_arena_free(), and the memory is reused after a reset.
+typedef struct fs_arena_block_st
+{
+  struct fs_arena_block_st *next;
+  size_t size;
+  size_t used;
+} fs_arena_block_t;
+
+typedef struct
+{
+  fs_arena_block_t *first;
+  fs_arena_block_t *current;
+  size_t block_size;
+} fs_arena_t;
+
+void fs_arena_init(fs_arena_t *arena, size_t block_size);
+void *fs_arena_alloc(fs_arena_t *arena, size_t size);
+char *fs_arena_strndup(fs_arena_t *arena, const char *s, size_t n);
+void fs_arena_reset(fs_arena_t *arena);
+void fs_arena_free(fs_arena_t *arena);
 #define S_FIFO 0x1000
 #define S_CHR 0x2000
 #define S_DIR 0x4000
@@ -96,6 +138,16 @@ typedef struct
 #define S_WOTH 0002
 #define S_XOTH 0001
 
+typedef struct
+{
+  // Zero selects the driver default for each field
+  uint32_t block_size; // Bytes per block (ext2: 1024, 2048 or 4096)
+  uint32_t inode_ratio; // Bytes of data per inode
+  uint32_t reserved; // Percent of blocks reserved for root
+  uint32_t cache_size; // Sectors of metadata to keep in memory when loading
+                       // (fat: FAT sectors, zero reads the whole FAT)
+} fs_options_t;
+
 struct fs_driver_st;
 
 typedef struct fs_st
@@ -106,20 +158,39 @@ typedef struct fs_st
   struct fs_driver_st *driver;
 } fs_t;
 
+typedef struct fs_file_st
+{
+  fs_t *fs;
+  INODE ino;
+  void *data; // Driver state kept while the file is open
+} fs_file_t;
+
 fs_t *fs_load(partition_t *p, fs_type_t type);
-fs_t *fs_create(partition_t *p, fs_type_t type);
+fs_t *fs_load_opt(partition_t *p, fs_type_t type, fs_options_t *opt);
+fs_t *fs_create(partition_t *p, fs_type_t type, fs_options_t *opt);
 void fs_close(fs_t *fs);
 int fs_check(fs_t *fs);
 
-int fs_read(fs_t *fs, INODE ino, void *buffer, size_t length, size_t offset);
-int fs_write(fs_t *fs, INODE ino, void *buffer, size_t length, size_t offset);
+size_t fs_read(fs_t *fs, INODE ino, void *buffer, size_t length, uint64_t offset);
+size_t fs_write(fs_t *fs, INODE ino, void *buffer, size_t length, uint64_t offset);
 INODE fs_touch(fs_t *fs, fstat_t *st);
 dirent_t *fs_readdir(fs_t *fs, INODE dir, unsigned int num);
+int fs_readdir_r(fs_t *fs, INODE dir, unsigned int num, dirent_t *de, char *name, size_t name_size);
+unsigned int fs_readdirplus(fs_t *fs, INODE dir, unsigned int num, direntplus_t *entries, unsigned int count, fs_arena_t *arena);
 int fs_link(fs_t *fs, INODE ino, INODE dir, const char *name);
 int fs_unlink(fs_t *fs, INODE dir, unsigned int num);
 fstat_t *fs_fstat(struct fs_st *fs, INODE ino);
+int fs_fstat_r(fs_t *fs, INODE ino, fstat_t *st);
 int fs_mkdir(struct fs_st *fs, INODE parent, const char *name);
 int fs_rmdir(fs_t *fs, INODE dir, unsigned int num);
+int fs_fallocate(fs_t *fs, INODE ino, uint64_t offset, uint64_t length);
+
+fs_file_t *fs_open(fs_t *fs, INODE ino);
+size_t fs_pread(fs_file_t *file, void *buffer, size_t length, uint64_t offset);
+size_t fs_pwrite(fs_file_t *file, void *buffer, size_t length, uint64_t offset);
+void fs_close_file(fs_file_t *file);
+fs_extent_t *fs_fiemap(fs_t *fs, INODE ino, unsigned int *count);
+uint64_t fs_copy_range(fs_t *src_fs, INODE src_ino, fs_t *dst_fs, INODE dst_ino, uint64_t src_offset, uint64_t dst_offset, uint64_t length);
 
 INODE fs_finddir(fs_t *fs, INODE dir, const char *name);
 INODE fs_find(fs_t *fs, const char *path);
@@ -11,11 +11,21 @@ fs_driver_t ext2_driver = {
   ext2_write,
   ext2_touch,
   ext2_readdir,
+  ext2_readdir_r,
+  ext2_readdirplus,
   ext2_link,
   ext2_unlink,
   ext2_fstat,
+  ext2_fstat_r,
   ext2_mkdir,
   ext2_rmdir,
+  ext2_fallocate,
+  0,
+  ext2_open,
+  ext2_pread,
+  ext2_pwrite,
+  ext2_close_file,
+  ext2_map,
   2,
   ext2_hook_load,
   ext2_hook_create,
@@ -30,7 +40,7 @@ int ext2_readblocks(struct fs_st *fs, void *buffer, size_t start, size_t len)
   if(!buffer)
     return 0;
 
-  size_t db_start = start*ext2_blocksize(fs)/BLOCK_SIZE;
+  uint64_t db_start = (uint64_t)start*ext2_blocksize(fs)/BLOCK_SIZE;
   size_t db_len = len*ext2_blocksize(fs)/BLOCK_SIZE;
 
   return partition_readblocks(fs->p, buffer, db_start, db_len);
@@ -43,7 +53,7 @@ int ext2_writeblocks(struct fs_st *fs, void *buffer, size_t start, size_t len)
   if(!buffer)
     return 0;
 
-  size_t db_start = start*ext2_blocksize(fs)/BLOCK_SIZE;
+  uint64_t db_start = (uint64_t)start*ext2_blocksize(fs)/BLOCK_SIZE;
   size_t db_len = len*ext2_blocksize(fs)/BLOCK_SIZE;
 
   return partition_writeblocks(fs->p, buffer, db_start, db_len);
@@ -102,12 +112,12 @@ int ext2_read_inode(struct fs_st *fs, ext2_inode_t *buffer, int num)
   size_t inooffset = (offset*data->superblock->inode_size)%ext2_blocksize(fs);
   inoblock += data->groups[group].inode_table;
 
-  char *buff = malloc(2*ext2_blocksize(fs));
+  if(!data->inode_buffer)
+    data->inode_buffer = malloc(2*ext2_blocksize(fs));
+  uint8_t *buff = data->inode_buffer;
   if(!ext2_readblocks(fs, buff, inoblock, 2))
     return 0;
-  memcpy(buffer, (void *)((size_t)buff + inooffset), sizeof(ext2_inode_t));
-
-  free(buff);
+  memcpy(buffer, buff + inooffset, sizeof(ext2_inode_t));
 
   return 1;
 }
@@ -121,6 +131,7 @@ int ext2_write_inode(struct fs_st *fs, ext2_inode_t *buffer, int num)
   ext2_data_t *data = fs->data;
   if(num > (int)data->superblock->num_inodes)
     return 0;
+  data->changes++;
 
   int group = (num-1) / data->superblock->inodes_per_group;
   int offset = (num-1) % data->superblock->inodes_per_group;
@@ -129,17 +140,49 @@ int ext2_write_inode(struct fs_st *fs, ext2_inode_t *buffer, int num)
   size_t inooffset = (offset*data->superblock->inode_size)%ext2_blocksize(fs);
   inoblock += data->groups[group].inode_table;
 
-  char *buff = malloc(2*ext2_blocksize(fs));
+  if(!data->inode_buffer)
+    data->inode_buffer = malloc(2*ext2_blocksize(fs));
+  uint8_t *buff = data->inode_buffer;
   if(!ext2_readblocks(fs, buff, inoblock, 2))
     return 0;
-  memcpy((void *)((size_t)buff + inooffset), buffer, sizeof(ext2_inode_t));
+  memcpy(buff + inooffset, buffer, sizeof(ext2_inode_t));
   ext2_writeblocks(fs, buff, inoblock, 2);
 
-  free(buff);
-
   return 1;
 }
 
+uint64_t ext2_size(ext2_inode_t *node)
+{
+  // size_high is only the upper half of the size for regular files. For
+  // directories it holds the directory ACL.
+  if(!node)
+    return 0;
+  uint64_t size = node->size_low;
+  if((node->type & 0xF000) == EXT2_REGULAR)
+    size |= (uint64_t)node->size_high << 32;
+  return size;
+}
+
+void ext2_set_size(fs_t *fs, ext2_inode_t *node, uint64_t size)
+{
+  if(!fs)
+    return;
+  if(!node)
+    return;
+  node->size_low = size & 0xFFFFFFFF;
+  if((node->type & 0xF000) != EXT2_REGULAR)
+    return;
+  node->size_high = size >> 32;
+
+  // Files of 2 Gb and more need the large file feature
+  ext2_data_t *data = fs->data;
+  if(size >= 0x80000000 && !(data->superblock->readwrite_features & EXT2_FEATURE_RO_LARGE_FILE))
+  {
+    data->superblock->readwrite_features |= EXT2_FEATURE_RO_LARGE_FILE;
+    data->superblock_dirty = 1;
+  }
+}
+
 void ext2_free_block(fs_t *fs, uint32_t block)
 {
   if(!fs)
@@ -147,72 +190,111 @@ void ext2_free_block(fs_t *fs, uint32_t block)
   if(!block)
     return;
   ext2_data_t *data = fs->data;
+  block -= data->superblock->superblock_block;
   unsigned int group = block / data->superblock->blocks_per_group;
 
   uint8_t *block_bitmap = malloc(ext2_blocksize(fs));
   if(!ext2_readblocks(fs, block_bitmap, data->groups[group].block_bitmap, 1))
     return;
   unsigned int i = block % data->superblock->blocks_per_group;
-  i--;
   block_bitmap[i/0x8] &= ~(1<<(i&0x7));
   if(!ext2_writeblocks(fs, block_bitmap, data->groups[group].block_bitmap, 1))
     return;
   free(block_bitmap);
   data->groups[group].unallocated_blocks ++;
   data->groups_dirty = 1;
+  data->superblock->num_free_blocks++;
+  data->superblock_dirty = 1;
 }
 
-uint32_t ext2_alloc_block(fs_t *fs, unsigned int group)
+uint32_t ext2_alloc_blocks(fs_t *fs, unsigned int group, uint32_t goal, uint32_t count, uint32_t *blocks)
 {
+  // Allocates up to count blocks into blocks, keeping them as contiguous
+  // as possible. The search starts at goal if it is a valid block,
+  // otherwise at the start of group. Returns the number allocated.
   if(!fs)
     return 0;
-  ext2_data_t *data = fs->data;
-  if(group > ext2_numgroups(fs))
-    return 0;
-  uint32_t retval = 0;
-
-  // Check if preferred group is ok, or find another one
-  if(!data->groups[group].unallocated_blocks)
-    for(group = 0; group < ext2_numgroups(fs); group++)
-      if(data->groups[group].unallocated_blocks)
-        break;
-  if(group == ext2_numgroups(fs))
+  if(!blocks)
     return 0;
+  ext2_data_t *data = fs->data;
+  uint32_t bpg = data->superblock->blocks_per_group;
+  uint32_t first = data->superblock->superblock_block;
+  uint32_t start = 0;
+  if(goal >= first && goal < data->superblock->num_blocks)
+  {
+    group = (goal - first) / bpg;
+    start = (goal - first) % bpg;
+  }
+  if(group >= data->num_groups)
+    group = 0;
 
-  // Load block bitmap
+  uint32_t done = 0;
   uint8_t *block_bitmap = malloc(ext2_blocksize(fs));
-  if(!ext2_readblocks(fs, block_bitmap, data->groups[group].block_bitmap, 1))
-    goto error;
+  unsigned int n;
+  for(n = 0; n < data->num_groups && done < count; n++, start = 0)
+  {
+    unsigned int g = (group + n) % data->num_groups;
+    if(!data->groups[g].unallocated_blocks)
+      continue;
+    if(!ext2_readblocks(fs, block_bitmap, data->groups[g].block_bitmap, 1))
+      break;
 
-  // Allocate a block
-  unsigned int i = 4 + data->superblock->inodes_per_group*sizeof(ext2_inode_t)/ext2_blocksize(fs) + 1;
-  while(block_bitmap[i/0x8]&(0x1<<(i&0x7)) && i < data->superblock->blocks_per_group)
-    i++;
-  if(i == data->superblock->blocks_per_group)
-    goto error;
-  block_bitmap[i/0x8] |= 0x1 << (i&0x7);
-  data->groups[group].unallocated_blocks--;
-  data->groups_dirty = 1;
-  data->superblock->num_free_blocks--;
-  data->superblock_dirty = 1;
-  i++;
-  i += data->superblock->blocks_per_group*group;
+    // Look for the first free run after start that fits the rest of the
+    // request. Failing that, take free blocks in order from start.
+    // The group's own metadata is marked as used in the bitmap
+    uint32_t want = count - done;
+    uint32_t run = 0, run_start = start, i = start;
+    while(i < bpg && run < want)
+    {
+      if(block_bitmap[i/0x8] == 0xFF && !(i&0x7))
+      {
+        run = 0;
+        i += 8;
+        continue;
+      }
+      if(block_bitmap[i/0x8]&(0x1<<(i&0x7)))
+        run = 0;
+      else if(!run++)
+        run_start = i;
+      i++;
+    }
+    if(run < want)
+      run_start = start;
 
-  // Write block bitmap back
-  if(!ext2_writeblocks(fs, block_bitmap, data->groups[group].block_bitmap, 1))
-    goto error;
+    uint32_t k;
+    for(k = 0; k < bpg && done < count && data->groups[g].unallocated_blocks; k++)
+    {
+      i = (run_start + k) % bpg;
+      if(block_bitmap[i/0x8]&(0x1<<(i&0x7)))
+        continue;
+      block_bitmap[i/0x8] |= 0x1 << (i&0x7);
+      blocks[done++] = i + first + bpg*g;
+      data->groups[g].unallocated_blocks--;
+      data->superblock->num_free_blocks--;
+    }
+    data->groups_dirty = 1;
+    data->superblock_dirty = 1;
 
-  retval = i;
+    // Write block bitmap back
+    if(!ext2_writeblocks(fs, block_bitmap, data->groups[g].block_bitmap, 1))
+      break;
+  }
 
-error:
-  if(block_bitmap)
-    free(block_bitmap);
-  return retval;
+  free(block_bitmap);
+  return done;
+}
+
+uint32_t ext2_alloc_block(fs_t *fs, unsigned int group)
+{
+  uint32_t block = 0;
+  if(!ext2_alloc_blocks(fs, group, 0, 1, &block))
+    return 0;
+  return block;
 }
 
-uint32_t ext2_count_indirect(fs_t *fs, size_t size)
+uint32_t ext2_count_indirect(fs_t *fs, uint64_t size)
 {
-  size_t num_blocks = size / ext2_blocksize(fs);
+  size_t num_blocks = size / ext2_blocksize(fs) + (size % ext2_blocksize(fs) != 0);
   uint32_t blocks_per_indirect = ext2_blocksize(fs)/sizeof(uint32_t);
   uint32_t block = 12;
   uint32_t ret = 0;
@@ -307,7 +389,7 @@ size_t ext2_get_indirect(fs_t *fs, uint32_t block, int level, uint32_t *block_li
     *block = block_list[bl_index];
     return 1;
   } else {
-    uint32_t *blocks = malloc(ext2_blocksize(fs));
+    uint32_t *blocks = calloc(1, ext2_blocksize(fs));
     size_t i = 0;
     size_t total_set_count = 0;
     if(indirects)
@@ -340,13 +422,14 @@ uint32_t *ext2_get_blocks(fs_t *fs, ext2_inode_t *node, uint32_t *indirects)
   if(!node)
     return 0;
 
-  int num_blocks = node->size_low/ext2_blocksize(fs) + (node->size_low%ext2_blocksize(fs) != 0);
+  uint64_t size = ext2_size(node);
+  size_t num_blocks = size/ext2_blocksize(fs) + (size%ext2_blocksize(fs) != 0);
 
   uint32_t *block_list = calloc(num_blocks + 1, sizeof(uint32_t));
 
   if(indirects)
     indirects[0] = 1;
-  int i;
+  size_t i;
   for(i = 0; i < num_blocks && i < 12; i++)
     block_list[i] = node->direct[i];
   if(i < num_blocks)
@@ -392,8 +475,8 @@ uint32_t *ext2_make_blocks(fs_t *fs, ext2_inode_t *node, int group)
     return 0;
   if(!node)
     return 0;
-  size_t blocks_needed = node->size_low / ext2_blocksize(fs);
-  if(node->size_low % ext2_blocksize(fs)) blocks_needed++;
+  size_t blocks_needed = ext2_size(node) / ext2_blocksize(fs);
+  if(ext2_size(node) % ext2_blocksize(fs)) blocks_needed++;
 
   uint32_t *block_list = calloc(blocks_needed + 1, sizeof(uint32_t));
   unsigned int i;
@@ -420,8 +503,8 @@ size_t ext2_read_data(fs_t *fs, ext2_inode_t *node, void *buffer, size_t length)
   if(!buffer)
     return 0;
 
-  if(length > node->size_low)
-    length = node->size_low;
+  if(length > ext2_size(node))
+    length = ext2_size(node);
   uint32_t *block_list = ext2_get_blocks(fs, node, 0);
 
   int i = 0;
@@ -443,66 +526,193 @@ size_t ext2_read_data(fs_t *fs, ext2_inode_t *node, void *buffer, size_t length)
 }
 
 
-int ext2_read(struct fs_st *fs, INODE ino, void *buffer, size_t length, size_t offset)
+int ext2_load_file(struct fs_st *fs, ext2_file_t *f, INODE ino)
+{
+  // Read the inode and block map of an open file
+  if(!ext2_read_inode(fs, &f->inode, ino))
+    return 1;
+  free(f->blocks);
+  f->blocks = ext2_get_blocks(fs, &f->inode, 0);
+  f->num_blocks = 0;
+  while(f->blocks[f->num_blocks])
+    f->num_blocks++;
+  f->changes = ((ext2_data_t *)fs->data)->changes;
+  return 0;
+}
+
+int ext2_open(struct fs_st *fs, fs_file_t *file)
 {
   if(!fs)
-    return 0;
-  if(ino < 2)
-    return 0;
-  if(!buffer)
-    return 0;
+    return 1;
+  if(!file)
+    return 1;
+  if(file->ino < 2)
+    return 1;
 
-  uint32_t *block_list = 0;
-  void *buff = 0;
-  ext2_inode_t *inode = malloc(sizeof(ext2_inode_t));
-  if(!ext2_read_inode(fs, inode, ino))
-    goto error;
-  if(offset > inode->size_low)
-    goto error;
-  if(offset + length > inode->size_low)
-    length = inode->size_low - offset;
+  ext2_file_t *f = calloc(1, sizeof(ext2_file_t));
+  if(ext2_load_file(fs, f, file->ino))
+  {
+    free(f);
+    return 1;
+  }
+  file->data = f;
+  return 0;
+}
+
+void ext2_close_file(struct fs_st *fs, fs_file_t *file)
+{
+  if(!fs)
+    return;
+  if(!file)
+    return;
+  ext2_file_t *f = file->data;
+  if(!f)
+    return;
+  free(f->blocks);
+  free(f);
+  file->data = 0;
+}
+
+int ext2_map(struct fs_st *fs, INODE ino, fs_extent_t **extents, unsigned int *count)
+{
+  // Block map of a file with runs of consecutive blocks merged
+  if(!fs)
+    return 1;
+  if(!extents)
+    return 1;
+  if(!count)
+    return 1;
 
+  ext2_file_t f = {0};
+  if(ino < 2 || ext2_load_file(fs, &f, ino))
+    return 1;
 
-  uint32_t start_block = offset/ext2_blocksize(fs);
-  size_t block_offset = offset%ext2_blocksize(fs);
-  int num_blocks = length/ext2_blocksize(fs);
-  if((length+block_offset)%ext2_blocksize(fs))
-    num_blocks++;
+  uint64_t bs = ext2_blocksize(fs);
+  fs_extent_t *map = calloc(f.num_blocks ? f.num_blocks : 1, sizeof(fs_extent_t));
+  unsigned int n = 0;
+  size_t i;
+  for(i = 0; i < f.num_blocks; i++)
+  {
+    if(n && map[n-1].physical + map[n-1].length == f.blocks[i]*bs)
+    {
+      map[n-1].length += bs;
+      continue;
+    }
+    map[n].logical = i*bs;
+    map[n].physical = f.blocks[i]*bs;
+    map[n].length = bs;
+    n++;
+  }
+  free(f.blocks);
 
-  
-  block_list = ext2_get_blocks(fs, inode, 0);
+  *extents = map;
+  *count = n;
+  return 0;
+}
 
-  
-  void *b = buff = malloc(num_blocks*ext2_blocksize(fs));
-  unsigned int i = start_block;
-  while(i < start_block + num_blocks && block_list[i])
+size_t ext2_io(struct fs_st *fs, fs_file_t *file, void *buffer, size_t length, uint64_t offset, int write)
+{
+  // Read or write part of an open file. Only partial blocks at the ends
+  // go through a temporary buffer, runs of whole blocks that are next to
+  // each other on disk are transferred in one call.
+  if(!fs)
+    return 0;
+  if(!file)
+    return 0;
+  if(!buffer)
+    return 0;
+  ext2_file_t *f = file->data;
+  if(!f)
+    return 0;
+  // The block map is only read again when an inode has been written
+  if(f->changes != ((ext2_data_t *)fs->data)->changes)
+    if(ext2_load_file(fs, f, file->ino))
+      return 0;
+
+  uint64_t size = ext2_size(&f->inode);
+  if(offset > size)
+    return 0;
+  if(offset + length > size)
+    length = size - offset;
+
+  size_t bs = ext2_blocksize(fs);
+  uint8_t *b = buffer;
+  uint8_t *bounce = 0;
+  size_t done = 0;
+  while(done < length)
   {
-    ext2_readblocks(fs, b, block_list[i], 1);
-    b = (void *)((size_t)b + ext2_blocksize(fs));
-    i++;
+    uint64_t index = (offset + done)/bs;
+    size_t start = (offset + done)%bs;
+    if(index >= f->num_blocks)
+      break;
+    if(start || length - done < bs)
+    {
+      // Partial block
+      size_t n = bs - start;
+      if(n > length - done)
+        n = length - done;
+      if(!bounce)
+        bounce = malloc(bs);
+      if(!ext2_readblocks(fs, bounce, f->blocks[index], 1))
+        break;
+      if(write)
+      {
+        memcpy(bounce + start, b + done, n);
+        if(!ext2_writeblocks(fs, bounce, f->blocks[index], 1))
+          break;
+      } else {
+        memcpy(b + done, bounce + start, n);
+      }
+      done += n;
+    } else {
+      size_t count = 1;
+      while(index + count < f->num_blocks && (count + 1)*bs <= length - done \
+          && f->blocks[index + count] == f->blocks[index] + count)
+        count++;
+      if(write)
+      {
+        if(!ext2_writeblocks(fs, b + done, f->blocks[index], count))
+          break;
+      } else {
+        if(!ext2_readblocks(fs, b + done, f->blocks[index], count))
+          break;
+      }
+      done += count*bs;
+    }
   }
-  if(i < start_block + num_blocks)
-    goto error;
 
-  memcpy(buffer, (void *)((size_t)buff + block_offset), length);
+  free(bounce);
+  return done;
+}
 
-  free(buff);
-  free(block_list);
-  free(inode);
+size_t ext2_pread(struct fs_st *fs, fs_file_t *file, void *buffer, size_t length, uint64_t offset)
+{
+  return ext2_io(fs, file, buffer, length, offset, 0);
+}
 
-  return length;
+size_t ext2_pwrite(struct fs_st *fs, fs_file_t *file, void *buffer, size_t length, uint64_t offset)
+{
+  return ext2_io(fs, file, buffer, length, offset, 1);
+}
 
-error:
-  if(inode)
-    free(inode);
-  if(block_list)
-    free(block_list);
-  if(buff)
-    free(buff);
-  return 0;
+size_t ext2_read(struct fs_st *fs, INODE ino, void *buffer, size_t length, uint64_t offset)
+{
+  if(!fs)
+    return 0;
+  if(ino < 2)
+    return 0;
+  if(!buffer)
+    return 0;
+
+  fs_file_t file = {fs, ino, 0};
+  if(ext2_open(fs, &file))
+    return 0;
+  size_t ret = ext2_pread(fs, &file, buffer, length, offset);
+  ext2_close_file(fs, &file);
+  return ret;
 }
 
-int ext2_write(struct fs_st *fs, INODE ino, void *buffer, size_t length, size_t offset)
+size_t ext2_write(struct fs_st *fs, INODE ino, void *buffer, size_t length, uint64_t offset)
 {
   if(!fs)
     return 0;
@@ -511,66 +721,220 @@ int ext2_write(struct fs_st *fs, INODE ino, void *buffer, size_t length, size_t
   if(!buffer)
     return 0;
 
+  fs_file_t file = {fs, ino, 0};
+  if(ext2_open(fs, &file))
+    return 0;
+  size_t ret = ext2_pwrite(fs, &file, buffer, length, offset);
+  ext2_close_file(fs, &file);
+  return ret;
+}
+
+int ext2_zero_blocks(struct fs_st *fs, uint32_t *blocks, size_t count)
+{
+  // Clears newly allocated data blocks, punching holes in the image
+  // file for contiguous runs where possible instead of writing zeros
+  uint32_t spb = ext2_blocksize(fs)/BLOCK_SIZE;
+  void *zero = 0;
+  size_t i = 0;
+  while(i < count)
+  {
+    size_t run = 1;
+    while(i + run < count && blocks[i + run] == blocks[i] + run)
+      run++;
+    if(!partition_discardblocks(fs->p, (uint64_t)blocks[i]*spb, (uint64_t)run*spb))
+    {
+      if(!zero)
+        zero = calloc(1, ext2_blocksize(fs));
+      size_t j;
+      for(j = 0; j < run; j++)
+        if(!ext2_writeblocks(fs, zero, blocks[i] + j, 1))
+          break;
+      if(j < run)
+        break;
+    }
+    i += run;
+  }
+  if(zero)
+    free(zero);
+  return i < count;
+}
+
+int ext2_fallocate(struct fs_st *fs, INODE ino, uint64_t offset, uint64_t length)
+{
+  if(!fs)
+    return 1;
+  if(ino < 2)
+    return 1;
+
+  int retval = 1;
   uint32_t *block_list = 0;
-  void *buff = 0;
+  uint32_t *indirects = 0;
   ext2_inode_t *inode = malloc(sizeof(ext2_inode_t));
   if(!ext2_read_inode(fs, inode, ino))
-    goto error;
-  if(offset > inode->size_low)
-    goto error;
-  if(offset + length > inode->size_low)
-    length = inode->size_low - offset;
-
-  uint32_t start_block = offset/ext2_blocksize(fs);
-  size_t block_offset = offset%ext2_blocksize(fs);
-  int num_blocks = length/ext2_blocksize(fs);
-  if((length+block_offset)%ext2_blocksize(fs))
-    num_blocks++;
-
-  block_list = ext2_get_blocks(fs, inode, 0);
-
-  void *b = buff = malloc(num_blocks*ext2_blocksize(fs));
-
-  // Copy first part of first block to buffer
-  // and fill the rest with input buffer data
-  void *b2 = malloc(ext2_blocksize(fs));
-  ext2_readblocks(fs, b2, block_list[start_block], 1);
-  memcpy(buff, b2, block_offset);
-  memcpy((void *)((size_t)buff + block_offset), buffer, length);
-
-  unsigned int i = start_block;
-  // Write first block from temp buffer
-  ext2_writeblocks(fs, buff, block_list[i], 1);
-  i++;
-  b = (void *)((size_t)b + ext2_blocksize(fs));
-  // Write rest from ordinary buffer
-  while(i < start_block + num_blocks && block_list[i])
+    goto end;
+
+  // Blocks are always allocated up to the file size, so only growing
+  // the file needs any work
+  uint64_t size = ext2_size(inode);
+  uint64_t new_size = offset + length;
+  if(new_size <= size)
   {
-    ext2_writeblocks(fs, b, block_list[i], 1);
-    b = (void *)((size_t)b + ext2_blocksize(fs));
-    i++;
+    retval = 0;
+    goto end;
   }
-  if(i < start_block + num_blocks)
-      goto error;
+  if((inode->type & 0xF000) != EXT2_REGULAR && new_size > 0xFFFFFFFF)
+    goto end;
 
-  free(buff);
-  free(b2);
-  free(block_list);
-  free(inode);
+  size_t old_count = size/ext2_blocksize(fs) + (size%ext2_blocksize(fs) != 0);
+  size_t new_count = new_size/ext2_blocksize(fs) + (new_size%ext2_blocksize(fs) != 0);
+  uint32_t old_indirect = ext2_count_indirect(fs, size);
+  uint32_t new_indirect = ext2_count_indirect(fs, new_size);
+  size_t needed = new_count - old_count;
+  ext2_data_t *data = fs->data;
+  if(data->superblock->num_free_blocks < needed + new_indirect - old_indirect)
+    goto end;
+
+  // Indirect blocks are listed in the order ext2_set_blocks uses them,
+  // and a larger tree only adds new ones at the end
+  indirects = calloc(new_indirect + 1, sizeof(uint32_t));
+  uint32_t *old_blocks = ext2_get_blocks(fs, inode, indirects);
+  if(!old_blocks)
+    goto end;
+  block_list = calloc(new_count + 1, sizeof(uint32_t));
+  memcpy(block_list, old_blocks, old_count*sizeof(uint32_t));
+  free(old_blocks);
+
+  // Continue right after the last block of the file if possible
+  uint32_t goal = old_count ? block_list[old_count - 1] + 1 : 0;
+  unsigned int group = ext2_inode_group(fs, ino);
+  uint32_t got = ext2_alloc_blocks(fs, group, goal, needed, &block_list[old_count]);
+  if(got == needed && new_indirect > old_indirect)
+  {
+    goal = needed ? block_list[new_count - 1] + 1 : goal;
+    got += ext2_alloc_blocks(fs, group, goal, new_indirect - old_indirect, &indirects[old_indirect + 1]);
+  }
+  if(got != needed + new_indirect - old_indirect)
+  {
+    size_t i;
+    for(i = old_count; i < new_count && block_list[i]; i++)
+      ext2_free_block(fs, block_list[i]);
+    for(i = old_indirect + 1; i <= new_indirect && indirects[i]; i++)
+      ext2_free_block(fs, indirects[i]);
+    goto end;
+  }
 
-  return length;
+  if(ext2_zero_blocks(fs, &block_list[old_count], needed))
+    goto end;
+  if(ext2_set_blocks(fs, inode, block_list, group, indirects) != new_count)
+    goto end;
+  ext2_set_size(fs, inode, new_size);
+  inode->disk_sectors += (needed + new_indirect - old_indirect)*(ext2_blocksize(fs)/BLOCK_SIZE);
+  if(!ext2_write_inode(fs, inode, ino))
+    goto end;
 
-error:
+  // Clear the rest of what used to be the last block
+  uint64_t end = (uint64_t)old_count*ext2_blocksize(fs);
+  if(end > size)
+  {
+    void *zero = calloc(1, end - size);
+    ext2_write(fs, ino, zero, end - size, size);
+    free(zero);
+  }
+  retval = 0;
+
+end:
   if(inode)
     free(inode);
   if(block_list)
     free(block_list);
-  if(buff)
-    free(buff);
-  return 0;
+  if(indirects)
+    free(indirects);
+  return retval;
+}
+
+int ext2_find_group(struct fs_st *fs, INODE parent, int is_dir, uint32_t blocks_needed)
+{
+  // Orlov-style group selection.
+  // Top level directories are spread out over groups with more free
+  // inodes and blocks than average and few directories. Other
+  // directories and files stay close to their parent directory.
+  if(!fs)
+    return -1;
+  ext2_data_t *data = fs->data;
+  unsigned int n = data->num_groups;
+  unsigned int parent_group = 0;
+  if(parent)
+    parent_group = ext2_inode_group(fs, parent);
+  if(parent_group >= n)
+    parent_group = 0;
+
+  uint32_t avg_free_inodes = data->superblock->num_free_inodes / n;
+  uint32_t avg_free_blocks = data->superblock->num_free_blocks / n;
+  uint32_t num_dirs = 0;
+  unsigned int i, g;
+  for(i = 0; i < n; i++)
+    num_dirs += data->groups[i].num_dir;
+
+  if(is_dir && parent == ext2_driver.root)
+  {
+    int best = -1;
+    // Start somewhere different each time
+    unsigned int start = num_dirs % n;
+    for(i = 0; i < n; i++)
+    {
+      g = (start + i) % n;
+      if(data->groups[g].unallocated_inodes < avg_free_inodes || !data->groups[g].unallocated_inodes)
+        continue;
+      if(data->groups[g].unallocated_blocks < avg_free_blocks)
+        continue;
+      if(best == -1 || data->groups[g].num_dir < data->groups[best].num_dir)
+        best = g;
+      else if(data->groups[g].num_dir == data->groups[best].num_dir && \
+          data->groups[g].unallocated_blocks > data->groups[best].unallocated_blocks)
+        best = g;
+    }
+    if(best != -1)
+      return best;
+  } else if(is_dir) {
+    // Only leave the parent's group if it has many directories already
+    // or is running out of space.
+    uint32_t max_dirs = num_dirs/n + data->superblock->inodes_per_group/16;
+    uint32_t min_inodes = avg_free_inodes - avg_free_inodes/4;
+    uint32_t min_blocks = avg_free_blocks - avg_free_blocks/4;
+    for(i = 0; i < n; i++)
+    {
+      g = (parent_group + i) % n;
+      if(data->groups[g].num_dir >= max_dirs)
+        continue;
+      if(data->groups[g].unallocated_inodes < min_inodes || !data->groups[g].unallocated_inodes)
+        continue;
+      if(data->groups[g].unallocated_blocks < min_blocks)
+        continue;
+      return g;
+    }
+  } else {
+    // Parent's group, then quadratic probing for a group that also
+    // fits the data
+    g = parent_group;
+    for(i = 1; i <= n; i <<= 1)
+    {
+      if(data->groups[g].unallocated_inodes && data->groups[g].unallocated_blocks >= blocks_needed)
+        return g;
+      g = (g + i) % n;
+    }
+  }
+
+  // Fall back to any group with a free inode
+  for(i = 0; i < n; i++)
+  {
+    g = (parent_group + i) % n;
+    if(data->groups[g].unallocated_inodes)
+      return g;
+  }
+  return -1;
 }
 
-INODE ext2_touch(struct fs_st *fs, fstat_t *st)
+INODE ext2_touch(struct fs_st *fs, fstat_t *st, INODE dir)
 {
   // Sanity check
   if(!fs)
@@ -590,30 +954,8 @@ INODE ext2_touch(struct fs_st *fs, fstat_t *st)
     return 0;
 
   // Find suitable group
-  int group = -1;
   unsigned int i = 0;
-  for(i = 0; i < data->num_groups; i++)
-  {
-    if(data->groups[i].unallocated_inodes)
-    {
-      if(data->groups[i].unallocated_blocks >= blocks_needed)
-      {
-        group = i;
-        break;
-      }
-    }
-  }
-  if(group == -1)
-  {
-    for(i = 0; i < data->num_groups; i++)
-    {
-      if(data->groups[i].unallocated_inodes)
-      {
-        group = i;
-        break;
-      }
-    }
-  }
+  int group = ext2_find_group(fs, dir, (st->mode & S_DIR) == S_DIR, blocks_needed + indirect_blocks);
   if(group == -1)
     return 0;
 
@@ -635,8 +977,10 @@ INODE ext2_touch(struct fs_st *fs, fstat_t *st)
     goto error;
 
   inode_bitmap[ino_num/0x8] |= (0x1<<(ino_num&0x7));
-  data->groups[i].unallocated_inodes--;
+  data->groups[group].unallocated_inodes--;
   data->groups_dirty = 1;
+  data->superblock->num_free_inodes--;
+  data->superblock_dirty = 1;
 
   ino_num += data->superblock->inodes_per_group*group;
   ino_num++; // Inodes start at 1
@@ -662,13 +1006,14 @@ INODE ext2_touch(struct fs_st *fs, fstat_t *st)
     ino->type = EXT2_SOCKET;
   ino->type |= st->mode & 0777;
   ino->uid = 0;
-  ino->size_low = st->size;
+  ino->size_high = 0;
+  ext2_set_size(fs, ino, st->size);
   ino->atime = st->atime;
   ino->ctime = st->ctime;
   ino->mtime = st->mtime;
   ino->gid = 0;
   ino->link_count = 0;
-  ino->disk_sectors = (blocks_needed+indirect_blocks)*ext2_blocksize(fs)/BLOCK_SIZE;
+  ino->disk_sectors = (blocks_needed+indirect_blocks)*(ext2_blocksize(fs)/BLOCK_SIZE);
   ino->flags = 0;
   ino->osval1 = 0;
   ino->indirect = 0;
@@ -676,7 +1021,6 @@ INODE ext2_touch(struct fs_st *fs, fstat_t *st)
   ino->tindirect = 0;
   ino->generation = 0;
   ino->extended_attributes = 0;
-  ino->size_high = 0;
   for(i = 0; i < 12; i++)
   {
     ino->direct[i] = 0;
@@ -686,12 +1030,10 @@ INODE ext2_touch(struct fs_st *fs, fstat_t *st)
   // Allocate blocks
   blocks = calloc((blocks_needed + 1), sizeof(uint32_t));
   indirect = calloc(indirect_blocks + 1, sizeof(uint32_t));
-  for(i = 0; i < blocks_needed; i++)
-    blocks[i] = ext2_alloc_block(fs, group);
-  for(i = 1; i <= indirect_blocks; i++)
-  {
-    indirect[i] = ext2_alloc_block(fs, group);
-  }
+  if(ext2_alloc_blocks(fs, group, 0, blocks_needed, blocks) != blocks_needed)
+    goto error;
+  if(ext2_alloc_blocks(fs, group, 0, indirect_blocks, &indirect[1]) != indirect_blocks)
+    goto error;
   if(ext2_set_blocks(fs, ino, blocks, group, indirect) != blocks_needed)
     goto error;
 
@@ -712,6 +1054,78 @@ error:
   return retval;
 }
 
+void ext2_inode_stat(ext2_inode_t *i, fstat_t *ret)
+{
+  ret->size = ext2_size(i);
+  ret->mode = 0;
+  if((i->type & EXT2_FIFO) == EXT2_FIFO) ret->mode |= S_FIFO;
+  if((i->type & EXT2_CHDEV) == EXT2_CHDEV) ret->mode |= S_CHR;
+  if((i->type & EXT2_DIR) == EXT2_DIR) ret->mode |= S_DIR;
+  if((i->type & EXT2_BDEV) == EXT2_BDEV) ret->mode |= S_BLK;
+  if((i->type & EXT2_REGULAR) == EXT2_REGULAR) ret->mode |= S_REG;
+  if((i->type & EXT2_SYMLINK) == EXT2_SYMLINK) ret->mode |= S_LINK;
+  if((i->type & EXT2_SOCKET) == EXT2_SOCKET) ret->mode |= S_SOCK;
+
+  if((i->type & EXT2_UR) == EXT2_UR) ret->mode |= S_RUSR;
+  if((i->type & EXT2_UW) == EXT2_UW) ret->mode |= S_WUSR;
+  if((i->type & EXT2_UX) == EXT2_UX) ret->mode |= S_XUSR;
+  if((i->type & EXT2_GR) == EXT2_GR) ret->mode |= S_RGRP;
+  if((i->type & EXT2_GW) == EXT2_GW) ret->mode |= S_WGRP;
+  if((i->type & EXT2_GX) == EXT2_GX) ret->mode |= S_XGRP;
+  if((i->type & EXT2_OR) == EXT2_OR) ret->mode |= S_ROTH;
+  if((i->type & EXT2_OW) == EXT2_OW) ret->mode |= S_WOTH;
+  if((i->type & EXT2_OX) == EXT2_OX) ret->mode |= S_XOTH;
+
+  ret->atime = i->atime;
+  ret->ctime = i->ctime;
+  ret->mtime = i->mtime;
+}
+
+ext2_dirinfo_t *ext2_dir_entry(struct fs_st *fs, INODE dir, unsigned int num)
+{
+  // Returns entry num of a directory, or 0 past the end. The directory
+  // is only read again after something has been written, and reading
+  // entries in order walks each record once.
+  ext2_data_t *data = fs->data;
+  if(dir != data->dir_ino || data->dir_changes != data->changes)
+  {
+    data->dir_ino = 0;
+    ext2_inode_t dir_ino;
+    if(!ext2_read_inode(fs, &dir_ino, dir))
+      return 0;
+    if(dir_ino.size_low > data->dir_capacity)
+    {
+      free(data->dir_data);
+      data->dir_data = malloc(dir_ino.size_low);
+      data->dir_capacity = dir_ino.size_low;
+    }
+    if(!ext2_read_data(fs, &dir_ino, data->dir_data, dir_ino.size_low))
+      return 0;
+    data->dir_ino = dir;
+    data->dir_size = dir_ino.size_low;
+    data->dir_changes = data->changes;
+    data->dir_num = 0;
+    data->dir_offset = 0;
+  }
+
+  if(num < data->dir_num)
+  {
+    data->dir_num = 0;
+    data->dir_offset = 0;
+  }
+  while(data->dir_num < num && data->dir_offset < data->dir_size)
+  {
+    ext2_dirinfo_t *di = (ext2_dirinfo_t *)(data->dir_data + data->dir_offset);
+    if(!di->record_length)
+      return 0;
+    data->dir_offset += di->record_length;
+    data->dir_num++;
+  }
+  if(data->dir_offset >= data->dir_size)
+    return 0;
+  return (ext2_dirinfo_t *)(data->dir_data + data->dir_offset);
+}
+
 dirent_t *ext2_readdir(struct fs_st *fs, INODE dir, unsigned int num)
 {
   if(!fs)
@@ -719,39 +1133,92 @@ dirent_t *ext2_readdir(struct fs_st *fs, INODE dir, unsigned int num)
   if(dir < 2)
     return 0;
 
-  ext2_inode_t *dir_ino = 0;
-  void *data = 0;
-  dirent_t *de = 0;
-  
+  ext2_dirinfo_t *di = ext2_dir_entry(fs, dir, num);
+  if(!di)
+    return 0;
 
-  dir_ino = malloc(sizeof(ext2_inode_t));
-  if(!ext2_read_inode(fs, dir_ino, dir))
-    goto end;
+  dirent_t *de = malloc(sizeof(dirent_t));
+  de->ino = di->inode;
+  de->name = strndup(di->name, di->name_length);
+  return de;
+}
 
-  data = malloc(dir_ino->size_low);
-  if(!ext2_read_data(fs, dir_ino, data, dir_ino->size_low))
-    goto end;
+int ext2_readdir_r(struct fs_st *fs, INODE dir, unsigned int num, dirent_t *de, char *name, size_t name_size)
+{
+  if(!fs)
+    return 1;
+  if(dir < 2)
+    return 1;
+
+  ext2_dirinfo_t *di = ext2_dir_entry(fs, dir, num);
+  if(!di)
+    return 1;
+
+  size_t length = di->name_length;
+  if(length > name_size - 1)
+    length = name_size - 1;
+  memcpy(name, di->name, length);
+  name[length] = '\0';
+  de->ino = di->inode;
+  de->name = name;
+  return 0;
+}
+
+unsigned int ext2_readdirplus(struct fs_st *fs, INODE dir, unsigned int num, direntplus_t *entries, unsigned int count, fs_arena_t *arena)
+{
+  // Like readdir, but for count entries at once and with their stats.
+  // The inodes are read in inode table order so each inode table block
+  // is read only once for the batch.
+  if(!fs)
+    return 0;
+  if(dir < 2)
+    return 0;
+  if(!entries)
+    return 0;
+  ext2_data_t *data = fs->data;
 
-  ext2_dirinfo_t *di = data;
-  while(num && (size_t)di < ((size_t)data + dir_ino->size_low))
+  unsigned int n = 0;
+  ext2_dirinfo_t *di;
+  while(n < count && (di = ext2_dir_entry(fs, dir, num + n)))
   {
-    di = (ext2_dirinfo_t *)((size_t)di + di->record_length);
-    num--;
+    entries[n].ino = di->inode;
+    entries[n].name = fs_arena_strndup(arena, di->name, di->name_length);
+    memset(&entries[n].st, 0, sizeof(fstat_t));
+    n++;
   }
-  if((size_t)di >= ((size_t)data + dir_ino->size_low))
-    goto end;
 
-  de = malloc(sizeof(dirent_t));
-  de->ino = di->inode;
-  de->name = strndup(di->name, di->name_length);
+  // Sort the batch by inode number
+  unsigned int *order = malloc(n*sizeof(unsigned int));
+  unsigned int i, j;
+  for(i = 0; i < n; i++)
+  {
+    for(j = i; j > 0 && entries[order[j - 1]].ino > entries[i].ino; j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
 
-end:
-  if(data)
-    free(data);
-  if(dir_ino)
-    free(dir_ino);
+  uint8_t *block = malloc(ext2_blocksize(fs));
+  uint32_t cached = 0;
+  for(i = 0; i < n; i++)
+  {
+    direntplus_t *e = &entries[order[i]];
+    if(!e->ino || e->ino > data->superblock->num_inodes)
+      continue;
+    uint32_t group = (e->ino - 1)/data->superblock->inodes_per_group;
+    uint32_t offset = ((e->ino - 1)%data->superblock->inodes_per_group)*data->superblock->inode_size;
+    uint32_t inoblock = data->groups[group].inode_table + offset/ext2_blocksize(fs);
+    if(inoblock != cached)
+    {
+      if(!ext2_readblocks(fs, block, inoblock, 1))
+        continue;
+      cached = inoblock;
+    }
+    ext2_inode_stat((ext2_inode_t *)(block + offset%ext2_blocksize(fs)), &e->st);
+  }
+  free(block);
+  free(order);
 
-  return de;
+  return n;
 }
 
 int ext2_link(struct fs_st *fs, INODE ino, INODE dir, const char *name)
@@ -817,8 +1284,8 @@ int ext2_link(struct fs_st *fs, INODE ino, INODE dir, const char *name)
     {
       blocks2[i] = blocks[i];
     }
-    blocks2[i] = ext2_alloc_block(fs, ino/data->superblock->inodes_per_group);
-    ext2_set_blocks(fs, dino, blocks2, ino/data->superblock->inodes_per_group, 0);
+    blocks2[i] = ext2_alloc_block(fs, ext2_inode_group(fs, dir));
+    ext2_set_blocks(fs, dino, blocks2, ext2_inode_group(fs, dir), 0);
     free(blocks);
     free(blocks2);
     dino->size_low += ext2_blocksize(fs);
@@ -828,6 +1295,7 @@ int ext2_link(struct fs_st *fs, INODE ino, INODE dir, const char *name)
 
   // Write index back
   ext2_write(fs, dir, di, dino->size_low, 0);
+  data->changes++;
 
   free(di);
   free(iino);
@@ -865,6 +1333,7 @@ int ext2_unlink(struct fs_st *fs, INODE dir, unsigned int num)
 
   p->record_length += di->record_length;
   ext2_write(fs, dir, buffer, dir_ino->size_low, 0);
+  data->changes++;
 
   free(buffer);
   free(dir_ino);
@@ -883,7 +1352,7 @@ int ext2_unlink(struct fs_st *fs, INODE dir, unsigned int num)
     child_ino->dtime = time(0);
     
     // Free blocks and inode if link count is zero
-    unsigned int indirect_num = ext2_count_indirect(fs, child_ino->size_low);
+    unsigned int indirect_num = ext2_count_indirect(fs, ext2_size(child_ino));
     uint32_t *iblocks = calloc(indirect_num+1, sizeof(uint32_t));
     uint32_t *blocks = ext2_get_blocks(fs, child_ino, iblocks);
 
@@ -902,9 +1371,8 @@ int ext2_unlink(struct fs_st *fs, INODE dir, unsigned int num)
     free(iblocks);
     free(blocks);
 
-    unsigned int group = child / data->superblock->inodes_per_group;
-    i = child % data->superblock->inodes_per_group;
-    i--;
+    unsigned int group = ext2_inode_group(fs, child);
+    i = (child - 1) % data->superblock->inodes_per_group;
     uint8_t *inode_bitmap = malloc(ext2_blocksize(fs));
     if(!ext2_readblocks(fs, inode_bitmap, data->groups[group].inode_bitmap, 1))
       return 1;
@@ -914,6 +1382,8 @@ int ext2_unlink(struct fs_st *fs, INODE dir, unsigned int num)
     free(inode_bitmap);
     data->groups[group].unallocated_inodes ++;
     data->groups_dirty = 1;
+    data->superblock->num_free_inodes++;
+    data->superblock_dirty = 1;
   }
   if(!ext2_write_inode(fs, child_ino, child))
     return 1;
@@ -933,35 +1403,26 @@ fstat_t *ext2_fstat(struct fs_st *fs, INODE ino)
     return 0;
 
   fstat_t *ret = malloc(sizeof(fstat_t));
-  ret->size = i->size_low;
-  ret->mode = 0;
-  if((i->type & EXT2_FIFO) == EXT2_FIFO) ret->mode |= S_FIFO;
-  if((i->type & EXT2_CHDEV) == EXT2_CHDEV) ret->mode |= S_CHR;
-  if((i->type & EXT2_DIR) == EXT2_DIR) ret->mode |= S_DIR;
-  if((i->type & EXT2_BDEV) == EXT2_BDEV) ret->mode |= S_BLK;
-  if((i->type & EXT2_REGULAR) == EXT2_REGULAR) ret->mode |= S_REG;
-  if((i->type & EXT2_SYMLINK) == EXT2_SYMLINK) ret->mode |= S_LINK;
-  if((i->type & EXT2_SOCKET) == EXT2_SOCKET) ret->mode |= S_SOCK;
-
-  if((i->type & EXT2_UR) == EXT2_UR) ret->mode |= S_RUSR;
-  if((i->type & EXT2_UW) == EXT2_UW) ret->mode |= S_WUSR;
-  if((i->type & EXT2_UX) == EXT2_UX) ret->mode |= S_XUSR;
-  if((i->type & EXT2_GR) == EXT2_GR) ret->mode |= S_RGRP;
-  if((i->type & EXT2_GW) == EXT2_GW) ret->mode |= S_WGRP;
-  if((i->type & EXT2_GX) == EXT2_GX) ret->mode |= S_XGRP;
-  if((i->type & EXT2_OR) == EXT2_OR) ret->mode |= S_ROTH;
-  if((i->type & EXT2_OW) == EXT2_OW) ret->mode |= S_WOTH;
-  if((i->type & EXT2_OX) == EXT2_OX) ret->mode |= S_XOTH;
-
-  ret->atime = i->atime;
-  ret->ctime = i->ctime;
-  ret->mtime = i->mtime;
+  ext2_inode_stat(i, ret);
 
   free(i);
   
   return ret;
 }
 
+int ext2_fstat_r(struct fs_st *fs, INODE ino, fstat_t *st)
+{
+  if(!fs)
+    return 1;
+  if(!ino)
+    return 1;
+  ext2_inode_t i;
+  if(!ext2_read_inode(fs, &i, ino))
+    return 1;
+  ext2_inode_stat(&i, st);
+  return 0;
+}
+
 int ext2_mkdir(struct fs_st *fs, INODE parent, const char *name)
 {
   if(!fs)
@@ -981,7 +1442,7 @@ int ext2_mkdir(struct fs_st *fs, INODE parent, const char *name)
   st.ctime = time(0);
   st.mtime = time(0);
 
-  INODE child = fs_touch(fs, &st);
+  INODE child = ext2_touch(fs, &st, parent);
   if(fs_link(fs, child, parent, name))
   {
     return 1;
@@ -995,7 +1456,7 @@ int ext2_mkdir(struct fs_st *fs, INODE parent, const char *name)
   free(ino);
 
   // Increase directory count
-  uint32_t group = child / data->superblock->inodes_per_group;
+  uint32_t group = ext2_inode_group(fs, child);
   data->groups[group].num_dir++;
   data->groups_dirty = 1;
 
@@ -1049,7 +1510,7 @@ int ext2_rmdir(struct fs_st *fs, INODE dir, unsigned int num)
   ext2_unlink(fs, dir, num);
 
   // Decrease directory count
-  uint32_t group = target / data->superblock->inodes_per_group;
+  uint32_t group = ext2_inode_group(fs, target);
   data->groups[group].num_dir--;
   data->groups_dirty = 1;
   
@@ -1057,9 +1518,11 @@ int ext2_rmdir(struct fs_st *fs, INODE dir, unsigned int num)
   return 0;
 }
 
-void *ext2_hook_load(struct fs_st *fs)
+void *ext2_hook_load(struct fs_st *fs, fs_options_t *opt)
 {
-  ext2_data_t *data = fs->data = malloc(sizeof(ext2_data_t));
+  (void)opt; // There are no load options for ext2
+
+  ext2_data_t *data = fs->data = calloc(1, sizeof(ext2_data_t));
 
   // Read superblock
   data->superblock = malloc(EXT2_SUPERBLOCK_SIZE);
@@ -1092,7 +1555,7 @@ void *ext2_hook_load(struct fs_st *fs)
   return 0;
 }
 
-void *ext2_hook_create(struct fs_st *fs)
+void *ext2_hook_create(struct fs_st *fs, fs_options_t *opt)
 {
 
   if(!fs)
@@ -1104,15 +1567,30 @@ void *ext2_hook_create(struct fs_st *fs)
 
   size_t max_size = fs->p->length * BLOCK_SIZE;
   uint32_t block_size_log = 0; // 1024 byte blocks
+  if(opt->block_size == 2048)
+    block_size_log = 1;
+  if(opt->block_size == 4096)
+    block_size_log = 2;
   uint32_t block_size = 1024 << block_size_log;
+  // With 1024 byte blocks, block 0 is the boot block and the first group
+  // starts at the superblock.
+  uint32_t first_block = (block_size == 1024)?1:0;
   max_size -= max_size % block_size;
   uint32_t max_blocks = max_size / block_size;
   uint32_t blocks_per_group = 8*block_size;
-  uint32_t num_groups = max_blocks / blocks_per_group + ((max_blocks % blocks_per_group)?1:0);
-  uint32_t last_group_blocks = max_blocks - blocks_per_group*(num_groups-1);
-
-  uint32_t blocks_per_inode = 8;
-  uint32_t inodes_per_group = blocks_per_group / blocks_per_inode;
+  uint32_t num_groups = (max_blocks - first_block) / blocks_per_group + \
+                        (((max_blocks - first_block) % blocks_per_group)?1:0);
+  uint32_t last_group_blocks = max_blocks - first_block - blocks_per_group*(num_groups-1);
+
+  // Inode table must fill whole blocks and the inode bitmap one block
+  uint32_t inode_ratio = opt->inode_ratio?opt->inode_ratio:8192;
+  uint32_t inodes_per_block = block_size / sizeof(ext2_inode_t);
+  uint32_t inodes_per_group = (uint64_t)blocks_per_group*block_size / inode_ratio;
+  inodes_per_group -= inodes_per_group % inodes_per_block;
+  if(inodes_per_group < inodes_per_block)
+    inodes_per_group = inodes_per_block;
+  if(inodes_per_group > 8*block_size)
+    inodes_per_group = 8*block_size;
 
   uint32_t inode_table_blocks = inodes_per_group*sizeof(ext2_inode_t)/block_size;
   if(last_group_blocks <= inode_table_blocks + 4)
@@ -1130,10 +1608,10 @@ void *ext2_hook_create(struct fs_st *fs)
   // Setup superblock
   s->num_inodes = total_inodes;
   s->num_blocks = max_blocks;
-  s->num_reserved_blocks = 0;
+  s->num_reserved_blocks = (uint64_t)max_blocks*opt->reserved/100;
   s->num_free_blocks = max_blocks;
-  s->num_free_inodes = total_inodes - first_inode;
-  s->superblock_block = 1;
+  s->num_free_inodes = total_inodes - (first_inode - 1);
+  s->superblock_block = first_block;
   s->block_size = block_size_log;
   s->fragment_size = block_size_log;
   s->blocks_per_group = blocks_per_group;
@@ -1178,9 +1656,15 @@ void *ext2_hook_create(struct fs_st *fs)
   ext2_groupd_t *g = data->groups = calloc(group_table_blocks, ext2_blocksize(fs));
   data->num_groups = num_groups;
 
+  // If the partition can be discarded it reads back as zeros, and only
+  // the metadata that isn't all zeros has to be written (lazy init).
+  int lazy = partition_discardblocks(fs->p, 0, fs->p->length);
+
   uint8_t *block_bitmap = calloc(1, block_size);
   uint8_t *inode_bitmap = calloc(1, block_size);
-  ext2_inode_t *inode_table = calloc(inode_table_blocks, block_size);
+  ext2_inode_t *inode_table = 0;
+  if(!lazy)
+    inode_table = calloc(inode_table_blocks, block_size);
 
   // Mark used blocks as used for each group
   uint32_t i;
@@ -1209,18 +1693,25 @@ void *ext2_hook_create(struct fs_st *fs)
 
     // Write bitmaps and inode table to each group
     ext2_writeblocks(fs, block_bitmap, g[i].block_bitmap, 1);
+    if(lazy)
+      continue;
     ext2_writeblocks(fs, inode_bitmap, g[i].inode_bitmap, 1);
     ext2_writeblocks(fs, inode_table, g[i].inode_table, inode_table_blocks);
   }
   data->groups_dirty = 1;
 
   // Pad end of last block bitmap
-  for(i = last_group_blocks-1; i < blocks_per_group; i++)
+  for(i = last_group_blocks; i < blocks_per_group; i++)
   {
     block_bitmap[i/8] |= 1 << (i&7);
   }
   ext2_writeblocks(fs, block_bitmap, g[num_groups-1].block_bitmap, 1);
-  g[num_groups-1].unallocated_blocks -= blocks_per_group-(last_group_blocks-1);
+  g[num_groups-1].unallocated_blocks -= blocks_per_group-last_group_blocks;
+
+  // Count free blocks
+  s->num_free_blocks = 0;
+  for(i = 0; i < num_groups; i++)
+    s->num_free_blocks += g[i].unallocated_blocks;
 
   // Fill start of first inode bitmap
   for(i = 0; i < first_inode-1; i++)
@@ -1264,11 +1755,12 @@ void *ext2_hook_create(struct fs_st *fs)
 
   free(block_bitmap);
   free(inode_bitmap);
-  free(inode_table);
+  if(inode_table)
+    free(inode_table);
   free(root_ino);
   free(di);
   // Done
-  return 0;
+  return data;
 }
 
 void ext2_hook_close(struct fs_st *fs)
@@ -1308,6 +1800,8 @@ void ext2_hook_close(struct fs_st *fs)
 
   free(data->superblock);
   free(data->groups);
+  free(data->inode_buffer);
+  free(data->dir_data);
   free(data);
 
   return;
@@ -55,6 +55,8 @@ typedef struct // Superblock
 
 #define EXT2_SUPERBLOCK_SIZE 1024
 
+#define EXT2_FEATURE_RO_LARGE_FILE 0x0002
+
 typedef struct // group
 {
   uint32_t block_bitmap;
@@ -139,31 +141,66 @@ typedef struct
   ext2_inode_t ino_buffer;
   uint32_t buffer_inode;
   int buffer_dirty;
+
+  uint32_t changes; // Counts inode and directory writes, see ext2_file_t
+  uint8_t *inode_buffer; // Two blocks for reading and writing inodes
+
+  // The last directory read by readdir and the position of the last
+  // entry found in it, kept until changes changes
+  INODE dir_ino;
+  uint8_t *dir_data;
+  uint32_t dir_size;
+  uint32_t dir_capacity;
+  uint32_t dir_changes;
+  unsigned int dir_num;
+  uint32_t dir_offset;
 } ext2_data_t;
 
+typedef struct // Open file
+{
+  ext2_inode_t inode;
+  uint32_t *blocks; // From ext2_get_blocks()
+  size_t num_blocks;
+  uint32_t changes; // Inode and blocks are read again if data->changes
+                    // is different
+} ext2_file_t;
+
 #define ext2_blocksize(fs) (1024 << ((ext2_data_t *)(fs)->data)->superblock->block_size)
+#define ext2_inode_group(fs, ino) (((ino) - 1) / ((ext2_data_t *)(fs)->data)->superblock->inodes_per_group)
 #define ext2_numgroups(fs) ((((ext2_data_t *)(fs)->data)->superblock->num_inodes / ((ext2_data_t *)(fs)->data)->superblock->inodes_per_group) + (((ext2_data_t *)(fs)->data)->superblock->num_inodes % ((ext2_data_t *)(fs)->data)->superblock->inodes_per_group != 0))
   
 
 
-int ext2_read(struct fs_st *fs, INODE ino, void *buffer, size_t length, size_t offset);
-int ext2_write(struct fs_st *fs, INODE ino, void *buffer, size_t length, size_t offset);
-INODE ext2_touch(struct fs_st *fs, fstat_t *st);
+size_t ext2_read(struct fs_st *fs, INODE ino, void *buffer, size_t length, uint64_t offset);
+size_t ext2_write(struct fs_st *fs, INODE ino, void *buffer, size_t length, uint64_t offset);
+INODE ext2_touch(struct fs_st *fs, fstat_t *st, INODE dir);
 dirent_t *ext2_readdir(struct fs_st *fs, INODE dir, unsigned int num);
+int ext2_readdir_r(struct fs_st *fs, INODE dir, unsigned int num, dirent_t *de, char *name, size_t name_size);
+unsigned int ext2_readdirplus(struct fs_st *fs, INODE dir, unsigned int num, direntplus_t *entries, unsigned int count, fs_arena_t *arena);
 int ext2_link(struct fs_st *fs, INODE ino, INODE dir, const char *name);
 int ext2_unlink(struct fs_st *fs, INODE dir, unsigned int num);
 fstat_t *ext2_fstat(struct fs_st *fs, INODE ino);
+int ext2_fstat_r(struct fs_st *fs, INODE ino, fstat_t *st);
 int ext2_mkdir(struct fs_st *fs, INODE parent, const char *name);
 int ext2_rmdir(struct fs_st *fs, INODE dir, unsigned int num);
+int ext2_fallocate(struct fs_st *fs, INODE ino, uint64_t offset, uint64_t length);
+int ext2_open(struct fs_st *fs, fs_file_t *file);
+size_t ext2_pread(struct fs_st *fs, fs_file_t *file, void *buffer, size_t length, uint64_t offset);
+size_t ext2_pwrite(struct fs_st *fs, fs_file_t *file, void *buffer, size_t length, uint64_t offset);
+void ext2_close_file(struct fs_st *fs, fs_file_t *file);
+int ext2_map(struct fs_st *fs, INODE ino, fs_extent_t **extents, unsigned int *count);
 INODE root;
 
-void *ext2_hook_load(struct fs_st *fs);
-void *ext2_hook_create(struct fs_st *fs);
+void *ext2_hook_load(struct fs_st *fs, fs_options_t *opt);
+void *ext2_hook_create(struct fs_st *fs, fs_options_t *opt);
 void ext2_hook_close(struct fs_st *fs);
 int ext2_hook_check(struct fs_st *fs);
 
 extern fs_driver_t ext2_driver;
+uint32_t ext2_alloc_blocks(fs_t *fs, unsigned int group, uint32_t goal, uint32_t count, uint32_t *blocks);
 uint32_t *ext2_get_blocks(fs_t *fs, ext2_inode_t *node, uint32_t *indirects);
 int ext2_read_inode(struct fs_st *fs, ext2_inode_t *buffer, int num);
+uint64_t ext2_size(ext2_inode_t *node);
+void ext2_set_size(struct fs_st *fs, ext2_inode_t *node, uint64_t size);
 int ext2_readblocks(struct fs_st *fs, void *buffer, size_t start, size_t len);
 int ext2_writeblocks(struct fs_st *fs, void *buffer, size_t start, size_t len);
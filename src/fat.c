@@ -4,6 +4,8 @@
 #include <dito.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <time.h>
 
@@ -12,11 +14,21 @@ fs_driver_t fat_driver = {
   fat_write,
   fat_touch,
   fat_readdir,
+  fat_readdir_r,
+  fat_readdirplus,
   fat_link,
   fat_unlink,
   fat_fstat,
+  fat_fstat_r,
   fat_mkdir,
   fat_rmdir,
+  fat_fallocate,
+  fat_lookup,
+  fat_open,
+  0,
+  0,
+  0,
+  fat_map,
   1,
   fat_hook_load,
   fat_hook_create,
@@ -24,31 +36,13 @@ fs_driver_t fat_driver = {
   fat_hook_check
 };
 
-int fat_bits(struct fs_st *fs)
-{
-  // Return values:
-  // 12: FAT12
-  // 16: FAT16
-  // 32: FAT32
-
-  if(!fs)
-    return 0;
-
-  if(fat_num_clusters(fs) < 4085)
-    return 12; // FAT12
-  if(fat_num_clusters(fs) < 65525)
-    return 16; // FAT16
-  return 32; // FAT32
-}
-
 size_t fat_readclusters(struct fs_st *fs, void *buffer, size_t cluster, size_t length)
 {
-  // cluster = 0 will read root directory for fat12/16
   // cluster >= 2 will read actual data clusters
   //
-  // Reading of root directory cannot be resumed. I.e. reading, for
-  // example, only the third cluster of the root directory is not
-  // possible.
+  // The FAT12/16 root directory is not made of clusters and is read
+  // with fat_read_root(). On FAT32 the root directory is an ordinary
+  // cluster chain starting at root_cluster in the BPB.
 
   if(!fs)
     return 0;
@@ -56,22 +50,18 @@ size_t fat_readclusters(struct fs_st *fs, void *buffer, size_t cluster, size_t l
     return 0;
   if(!length)
     return 0;
+  if(cluster < 2)
+    return 0;
 
-  size_t start = fat_first_data_sector(fs);
-  if(cluster >= 2)
-  {
-    start += fat_root_sectors(fs);
-    start += (cluster-2)*fat_bpb(fs)->sectors_per_cluster;
-  }
-  length *= fat_bpb(fs)->sectors_per_cluster;
+  size_t start = fat_data_start(fs) + (cluster-2)*fat_geo(fs)->cluster_sectors;
+  length *= fat_geo(fs)->cluster_sectors;
 
   return partition_readblocks(fs->p, buffer, start, length);
 }
 
 size_t fat_writeclusters(struct fs_st *fs, void *buffer, size_t cluster, size_t length)
 {
-  // See comments in fat_redcluster() re: reading root directory
-  // clusters.
+  // See comments in fat_readclusters() re: the root directory
 
   if(!fs)
     return 0;
@@ -79,71 +69,481 @@ size_t fat_writeclusters(struct fs_st *fs, void *buffer, size_t cluster, size_t
     return 0;
   if(!length)
     return 0;
+  if(cluster < 2)
+    return 0;
 
-  size_t start = fat_first_data_sector(fs);
-  if(cluster >= 2)
-  {
-    start += fat_root_sectors(fs);
-    start += (cluster-2)*fat_bpb(fs)->sectors_per_cluster;
-  }
-  length *= fat_bpb(fs)->sectors_per_cluster;
+  size_t start = fat_data_start(fs) + (cluster-2)*fat_geo(fs)->cluster_sectors;
+  length *= fat_geo(fs)->cluster_sectors;
 
   return partition_writeblocks(fs->p, buffer, start, length);
 }
 
-uint32_t fat_read_fat(struct fs_st *fs, uint32_t cluster)
-{
-  if(!fs)
-    return 0;
-
-  // Only implemented for FAT12 right now.
-  if(fat_bits(fs) != 12)
-    return 0;
+// Read and write entries in the on-disk FAT. End of chain and bad
+// cluster markers are extended to 28 bits when read.
 
+uint32_t fat_decode12(uint8_t *fat, uint32_t cluster)
+{
   uint32_t offset = cluster + cluster/2;
-  uint16_t value = *(uint16_t *)&(fat_data(fs)->fat[offset]);
+  uint32_t value = fat[offset] | (fat[offset+1] << 8);
   if (cluster & 0x0001)
     value >>= 4;
   else
     value &= 0x0FFF;
+  if(value >= 0xFF7)
+    value |= 0x0FFFF000;
   return value;
 }
 
-void fat_write_fat(struct fs_st *fs, uint32_t cluster, uint32_t set)
+uint32_t fat_decode16(uint8_t *fat, uint32_t cluster)
 {
-  if(!fs)
-    return;
+  uint32_t value = ((uint16_t *)fat)[cluster];
+  if(value >= 0xFFF7)
+    value |= 0x0FFF0000;
+  return value;
+}
 
-  // Only implemented for FAT12 right now.
-  if(fat_bits(fs) != 12)
-    return;
+uint32_t fat_decode32(uint8_t *fat, uint32_t cluster)
+{
+  // The top four bits of FAT32 entries are reserved
+  return ((uint32_t *)fat)[cluster] & 0x0FFFFFFF;
+}
 
+void fat_encode12(uint8_t *fat, uint32_t cluster, uint32_t set)
+{
   uint32_t offset = cluster + cluster/2;
-  uint16_t value = *(uint16_t *)&(fat_data(fs)->fat[offset]);
+  uint16_t value = fat[offset] | (fat[offset+1] << 8);
   if(cluster & 0x0001)
-    value = (value & 0x000F) | (set << 4);
+    value = (value & 0x000F) | ((set & 0x0FFF) << 4);
   else
     value = (value & 0xF000) | (set & 0x0FFF);
-  *(uint16_t *)&(fat_data(fs)->fat[offset]) = value;
+  fat[offset] = value & 0xFF;
+  fat[offset+1] = value >> 8;
 }
 
-uint32_t fat_find_free(struct fs_st *fs)
+void fat_encode16(uint8_t *fat, uint32_t cluster, uint32_t set)
+{
+  ((uint16_t *)fat)[cluster] = set & 0xFFFF;
+}
+
+void fat_encode32(uint8_t *fat, uint32_t cluster, uint32_t set)
+{
+  uint32_t *entry = &((uint32_t *)fat)[cluster];
+  *entry = (*entry & 0xF0000000) | (set & 0x0FFFFFFF);
+}
+
+void fat_compute_geometry(struct fs_st *fs)
+{
+  // Work out where everything is from the BPB once, instead of every
+  // time a cluster or FAT entry is accessed
+  fat_bpb_t *bpb = fat_bpb(fs);
+  fat_geometry_t *geo = fat_geo(fs);
+
+  geo->fat_start = bpb->reserved_sectors;
+  geo->fat_sectors = bpb->sectors_per_fat?bpb->sectors_per_fat:bpb->fat32.sectors_per_fat;
+  geo->root_start = geo->fat_start + bpb->fat_count*geo->fat_sectors;
+  geo->root_sectors = (bpb->root_count*32 + bpb->bytes_per_sector - 1)/bpb->bytes_per_sector;
+  geo->data_start = geo->root_start + geo->root_sectors;
+  geo->cluster_sectors = bpb->sectors_per_cluster;
+  geo->cluster_size = bpb->bytes_per_sector*bpb->sectors_per_cluster;
+  geo->cluster_shift = 0;
+  while((1u << geo->cluster_shift) < geo->cluster_size)
+    geo->cluster_shift++;
+
+  uint32_t total = bpb->total_sectors_small + bpb->total_sectors_large;
+  geo->num_clusters = 0;
+  if(geo->cluster_sectors && total > geo->data_start)
+    geo->num_clusters = (total - geo->data_start)/geo->cluster_sectors;
+
+  // The FAT type is decided by the number of clusters
+  if(geo->num_clusters < 4085)
+  {
+    geo->bits = 12;
+    geo->decode = fat_decode12;
+    geo->encode = fat_encode12;
+  } else if(geo->num_clusters < 65525) {
+    geo->bits = 16;
+    geo->decode = fat_decode16;
+    geo->encode = fat_encode16;
+  } else {
+    geo->bits = 32;
+    geo->decode = fat_decode32;
+    geo->encode = fat_encode32;
+  }
+}
+
+uint32_t fat_count_entries(struct fs_st *fs)
+{
+  // Number of usable FAT entries
+  uint32_t count = (uint64_t)fat_sectors_per_fat(fs)*BLOCK_SIZE*8/fat_bits(fs);
+  if(count > fat_num_clusters(fs) + 2)
+    count = fat_num_clusters(fs) + 2;
+  return count;
+}
+
+void fat_load_table(struct fs_st *fs)
+{
+  // Decode the on-disk FAT so lookups are plain array reads
+  fat_data_t *data = fat_data(fs);
+  fat_geometry_t *geo = fat_geo(fs);
+  uint32_t sectors = geo->fat_sectors;
+  data->num_entries = fat_count_entries(fs);
+  free(data->table);
+  data->table = calloc(data->num_entries, sizeof(uint32_t));
+  uint32_t i;
+  for(i = 0; i < data->num_entries; i++)
+    data->table[i] = geo->decode(data->fat, i);
+  free(data->dirty);
+  data->dirty = calloc(sectors/32 + 1, sizeof(uint32_t));
+}
+
+void fat_setup_pages(struct fs_st *fs, uint32_t sectors)
+{
+  // Read the FAT on demand, keeping at most about sectors of it in
+  // memory
+  fat_data_t *data = fat_data(fs);
+  data->num_entries = fat_count_entries(fs);
+  data->num_pages = sectors/FAT_PAGE_SECTORS;
+  if(!data->num_pages)
+    data->num_pages = 1;
+  data->pages = calloc(data->num_pages, sizeof(fat_page_t));
+  uint32_t i;
+  for(i = 0; i < data->num_pages; i++)
+  {
+    data->pages[i].page = FAT_NO_ENTRY;
+    data->pages[i].data = malloc(FAT_PAGE_SECTORS*BLOCK_SIZE);
+  }
+}
+
+void fat_flush_page(struct fs_st *fs, fat_page_t *page)
+{
+  // Write a changed page to every copy of the FAT
+  if(!page->dirty)
+    return;
+  fat_data_t *data = fat_data(fs);
+  uint32_t sector = page->page*FAT_PAGE_SECTORS;
+  uint32_t count = FAT_PAGE_SECTORS;
+  if(sector + count > fat_sectors_per_fat(fs))
+    count = fat_sectors_per_fat(fs) - sector;
+  int copy;
+  for(copy = 0; copy < data->bpb->fat_count; copy++)
+    partition_writeblocks(fs->p, page->data, \
+        fat_fat_start(fs) + copy*fat_sectors_per_fat(fs) + sector, count);
+  page->dirty = 0;
+}
+
+fat_page_t *fat_get_page(struct fs_st *fs, uint32_t cluster)
+{
+  // Returns the page holding the FAT entry of a cluster, reading it if
+  // needed. The page it replaces is written back first if changed.
+  fat_data_t *data = fat_data(fs);
+  uint32_t page = ((uint64_t)cluster*(fat_bits(fs)/8))/(FAT_PAGE_SECTORS*BLOCK_SIZE);
+  fat_page_t *pg = &data->pages[page%data->num_pages];
+  if(pg->page == page)
+    return pg;
+
+  fat_flush_page(fs, pg);
+  uint32_t sector = page*FAT_PAGE_SECTORS;
+  uint32_t count = FAT_PAGE_SECTORS;
+  if(sector + count > fat_sectors_per_fat(fs))
+    count = fat_sectors_per_fat(fs) - sector;
+  partition_readblocks(fs->p, pg->data, fat_fat_start(fs) + sector, count);
+  pg->page = page;
+  return pg;
+}
+
+void fat_sync_fat(struct fs_st *fs)
+{
+  // Encode the changed entries and write the sectors they are in to
+  // every copy of the FAT
+  fat_data_t *data = fat_data(fs);
+  uint32_t i;
+  for(i = 0; i < data->num_pages; i++)
+    fat_flush_page(fs, &data->pages[i]);
+  if(!data->table)
+    return;
+  int bits = fat_bits(fs);
+  uint32_t sectors = fat_sectors_per_fat(fs);
+  uint32_t sector = 0;
+  while(sector < sectors)
+  {
+    if(!(data->dirty[sector/32] & (1u << (sector%32))))
+    {
+      sector++;
+      continue;
+    }
+    // Find the run of dirty sectors starting here
+    uint32_t end = sector;
+    while(end < sectors && (data->dirty[end/32] & (1u << (end%32))))
+    {
+      data->dirty[end/32] &= ~(1u << (end%32));
+      end++;
+    }
+    // Entries with any bits in the run
+    uint32_t first = (uint64_t)sector*BLOCK_SIZE*8/bits;
+    uint32_t last = ((uint64_t)end*BLOCK_SIZE*8 + bits - 1)/bits;
+    if(last > data->num_entries)
+      last = data->num_entries;
+    uint32_t i;
+    for(i = first; i < last; i++)
+      fat_geo(fs)->encode(data->fat, i, data->table[i]);
+
+    int copy;
+    for(copy = 0; copy < data->bpb->fat_count; copy++)
+      partition_writeblocks(fs->p, &data->fat[sector*BLOCK_SIZE], \
+          fat_fat_start(fs) + copy*sectors + sector, end - sector);
+    sector = end;
+  }
+}
+
+uint32_t fat_read_fat(struct fs_st *fs, uint32_t cluster)
 {
   if(!fs)
     return 0;
 
-  uint32_t i = 3; // Skip first two entries
-  while(i < fat_num_clusters(fs))
+  fat_data_t *data = fat_data(fs);
+  // Treat entries outside the FAT as end of chain
+  if(cluster >= data->num_entries)
+    return FAT_EOC;
+  if(data->table)
+    return data->table[cluster];
+
+  fat_page_t *pg = fat_get_page(fs, cluster);
+  uint32_t per_page = FAT_PAGE_SECTORS*BLOCK_SIZE*8/fat_bits(fs);
+  return fat_geo(fs)->decode(pg->data, cluster - pg->page*per_page);
+}
+
+void fat_write_fat(struct fs_st *fs, uint32_t cluster, uint32_t set)
+{
+  if(!fs)
+    return;
+
+  fat_data_t *data = fat_data(fs);
+  if(cluster >= data->num_entries)
+    return;
+  data->fat_changed = 1;
+  if(data->table)
   {
-    if(fat_read_fat(fs, i))
-      i++;
-    else
+    data->table[cluster] = set & 0x0FFFFFFF;
+
+    // Mark the sectors the entry is stored in, a FAT12 entry can span two
+    int bits = fat_bits(fs);
+    uint64_t bit = (uint64_t)cluster*bits;
+    uint32_t sector = bit/8/BLOCK_SIZE;
+    uint32_t last = (bit + bits - 1)/8/BLOCK_SIZE;
+    for(; sector <= last; sector++)
+      data->dirty[sector/32] |= 1u << (sector%32);
+  } else {
+    fat_page_t *pg = fat_get_page(fs, cluster);
+    uint32_t per_page = FAT_PAGE_SECTORS*BLOCK_SIZE*8/fat_bits(fs);
+    fat_geo(fs)->encode(pg->data, cluster - pg->page*per_page, set);
+    pg->dirty = 1;
+  }
+
+  // Keep the free cluster index up to date
+  if(data->free_map && cluster >= 2 && cluster < fat_num_clusters(fs) + 2)
+  {
+    uint32_t bit = 1u << (cluster%32);
+    if(!set && !(data->free_map[cluster/32] & bit))
+    {
+      data->free_map[cluster/32] |= bit;
+      data->num_free++;
+    } else if(set && (data->free_map[cluster/32] & bit)) {
+      data->free_map[cluster/32] &= ~bit;
+      data->num_free--;
+    }
+  }
+}
+
+void fat_build_free_map(struct fs_st *fs)
+{
+  // Index the free clusters so allocation doesn't have to scan the FAT
+  fat_data_t *data = fat_data(fs);
+  uint32_t end = fat_num_clusters(fs) + 2;
+  free(data->free_map);
+  data->free_map = calloc(end/32 + 1, sizeof(uint32_t));
+  data->num_free = 0;
+  uint32_t i;
+  for(i = 2; i < end; i++)
+  {
+    if(!fat_read_fat(fs, i))
+    {
+      data->free_map[i/32] |= 1u << (i%32);
+      data->num_free++;
+    }
+  }
+}
+
+fat_data_t *fat_free_data(struct fs_st *fs)
+{
+  // The free cluster index is built the first time it is needed, so
+  // read-only use of a paged FAT never scans all of it
+  fat_data_t *data = fat_data(fs);
+  if(!data->free_map)
+    fat_build_free_map(fs);
+  return data;
+}
+
+uint32_t fat_scan_free(fat_data_t *data, uint32_t start, uint32_t end)
+{
+  // First free cluster in [start, end), or 0
+  uint32_t i = start;
+  while(i < end)
+  {
+    if(!(i%32) && !data->free_map[i/32])
+    {
+      i += 32;
+      continue;
+    }
+    if(data->free_map[i/32] & (1u << (i%32)))
       return i;
+    i++;
+  }
+  return 0;
+}
+
+uint32_t fat_find_free(struct fs_st *fs)
+{
+  // Returns a free cluster, starting the search where the last one was
+  // found, or 0 if the disk is full
+  if(!fs)
+    return 0;
+  fat_data_t *data = fat_free_data(fs);
+  if(!data->num_free)
+    return 0;
+
+  uint32_t end = fat_num_clusters(fs) + 2;
+  uint32_t hint = data->next_free;
+  if(hint < 2 || hint >= end)
+    hint = 2;
+  uint32_t ret = fat_scan_free(data, hint, end);
+  if(!ret)
+    ret = fat_scan_free(data, 2, hint);
+  if(ret)
+    data->next_free = ret + 1;
+  return ret;
+}
+
+uint32_t fat_find_free_run(struct fs_st *fs, uint32_t count)
+{
+  // Returns the first cluster of a run of count free clusters, or 0
+  if(!fs)
+    return 0;
+  if(!count)
+    return 0;
+  fat_data_t *data = fat_free_data(fs);
+  if(data->num_free < count)
+    return 0;
+
+  uint32_t end = fat_num_clusters(fs) + 2;
+  uint32_t hint = data->next_free;
+  if(hint < 2 || hint >= end)
+    hint = 2;
+  int pass;
+  for(pass = 0; pass < 2; pass++)
+  {
+    uint32_t i = pass?2:hint;
+    uint32_t stop = pass?hint:end;
+    while((i = fat_scan_free(data, i, stop)))
+    {
+      uint32_t run = 1;
+      while(run < count && i + run < stop \
+          && (data->free_map[(i + run)/32] & (1u << ((i + run)%32))))
+        run++;
+      if(run == count)
+      {
+        data->next_free = i + count;
+        return i;
+      }
+      i += run;
+    }
   }
 
   return 0;
 }
 
+uint32_t fat_free_length(fat_data_t *data, uint32_t start, uint32_t end)
+{
+  // Number of free clusters in a row from start, stopping at end
+  uint32_t i = start;
+  while(i < end)
+  {
+    if(!(i%32) && i + 32 <= end && data->free_map[i/32] == 0xFFFFFFFF)
+    {
+      i += 32;
+      continue;
+    }
+    if(!(data->free_map[i/32] & (1u << (i%32))))
+      break;
+    i++;
+  }
+  return i - start;
+}
+
+uint32_t fat_find_best_run(struct fs_st *fs, uint32_t count, uint32_t *length)
+{
+  // Returns the first cluster of a run of free clusters that holds count
+  // clusters, taking the first one after the last allocation. If there
+  // is none there, the smallest such run on the disk is used, or the
+  // largest run so the rest can be taken from as few other runs as
+  // possible. The length of the run is stored in length.
+  if(!fs)
+    return 0;
+  fat_data_t *data = fat_free_data(fs);
+  if(!data->num_free || !count)
+    return 0;
+
+  uint32_t end = fat_num_clusters(fs) + 2;
+  uint32_t hint = data->next_free;
+  if(hint < 2 || hint >= end)
+    hint = 2;
+  uint32_t i = hint;
+  while((i = fat_scan_free(data, i, end)))
+  {
+    uint32_t run = fat_free_length(data, i, end);
+    if(run >= count)
+    {
+      data->next_free = i + count;
+      *length = run;
+      return i;
+    }
+    i += run;
+  }
+
+  uint32_t best = 0, best_length = 0;
+  i = 2;
+  while((i = fat_scan_free(data, i, end)))
+  {
+    uint32_t run = fat_free_length(data, i, end);
+    if(run == count)
+    {
+      best = i;
+      best_length = run;
+      break;
+    }
+    if((run > count && (best_length < count || run < best_length)) \
+        || (run < count && run > best_length))
+    {
+      best = i;
+      best_length = run;
+    }
+    i += run;
+  }
+
+  if(best)
+    data->next_free = best + ((best_length < count)?best_length:count);
+  *length = best_length;
+  return best;
+}
+
+void fat_link_run(struct fs_st *fs, uint32_t start, uint32_t count)
+{
+  // Chain count consecutive clusters together and end the chain
+  uint32_t i;
+  for(i = start; i < start + count - 1; i++)
+    fat_write_fat(fs, i, i + 1);
+  fat_write_fat(fs, i, FAT_EOC);
+}
+
 fat_inode_t *fat_get_inode(struct fs_st *fs, INODE ino)
 {
   if(!fs)
@@ -151,70 +551,286 @@ fat_inode_t *fat_get_inode(struct fs_st *fs, INODE ino)
   if(!ino)
     return 0;
 
-  ino--;
-  fat_inode_t *ret = fat_data(fs)->inodes;
-  while(ino)
+  if(ino >= fat_data(fs)->next)
+    return 0;
+  return fat_data(fs)->inodes[ino - 1];
+}
+
+INODE fat_add_inode(struct fs_st *fs, fat_inode_t *inode)
+{
+  // Inodes are allocated one by one so pointers stay valid when the
+  // table grows
+  if(!fs)
+    return 0;
+  if(!inode)
+    return 0;
+
+  fat_data_t *data = fat_data(fs);
+  if(data->next - 1 >= data->max_inodes)
   {
-    ret = ret->next;
-    ino--;
-    if(!ret)
+    unsigned int max = data->max_inodes?data->max_inodes*2:16;
+    fat_inode_t **inodes = realloc(data->inodes, max*sizeof(fat_inode_t *));
+    if(!inodes)
       return 0;
+    data->inodes = inodes;
+    data->max_inodes = max;
   }
-  return ret;
+  inode->dir_index = FAT_NO_ENTRY;
+  inode->hash_next = 0;
+  data->inodes[data->next - 1] = inode;
+  return data->next++;
 }
 
-uint32_t fat_clustercount(struct fs_st *fs, INODE ino)
+unsigned int fat_entry_hash(fat_data_t *data, uint32_t dir_cluster, uint32_t dir_index)
+{
+  return ((dir_cluster * 2654435761u) ^ dir_index) & (data->num_buckets - 1);
+}
+
+INODE fat_find_entry(struct fs_st *fs, uint32_t dir_cluster, uint32_t dir_index)
 {
+  // Find the inode already made for a directory entry, if any
   if(!fs)
     return 0;
-  if(!ino)
+  fat_data_t *data = fat_data(fs);
+  if(!data->num_buckets)
     return 0;
 
-  if(ino == 1) // Special case for root directory (FAT12/16)
+  INODE ino = data->buckets[fat_entry_hash(data, dir_cluster, dir_index)];
+  while(ino)
   {
-    return fat_bpb(fs)->root_count*32/fat_clustersize(fs);
+    fat_inode_t *inode = data->inodes[ino - 1];
+    if(inode->dir_cluster == dir_cluster && inode->dir_index == dir_index)
+      return ino;
+    ino = inode->hash_next;
   }
+  return 0;
+}
 
-  uint32_t ret = 0;
+void fat_unhash_entry(struct fs_st *fs, INODE ino)
+{
   fat_inode_t *inode = fat_get_inode(fs, ino);
+  if(!inode)
+    return;
+  if(inode->dir_index == FAT_NO_ENTRY)
+    return;
+
+  fat_data_t *data = fat_data(fs);
+  INODE *link = &data->buckets[fat_entry_hash(data, inode->dir_cluster, inode->dir_index)];
+  while(*link && *link != ino)
+    link = &data->inodes[*link - 1]->hash_next;
+  if(*link)
+    *link = inode->hash_next;
+  inode->hash_next = 0;
+  inode->dir_index = FAT_NO_ENTRY;
+  data->num_hashed--;
+}
+
+void fat_hash_entry(struct fs_st *fs, INODE ino, uint32_t dir_cluster, uint32_t dir_index)
+{
+  // Record where the directory entry of an inode is
+  fat_inode_t *inode = fat_get_inode(fs, ino);
+  if(!inode)
+    return;
+  fat_unhash_entry(fs, ino);
+
+  fat_data_t *data = fat_data(fs);
+  if(data->num_hashed >= data->num_buckets)
+  {
+    // Grow and rehash everything
+    unsigned int num = data->num_buckets?data->num_buckets*2:64;
+    INODE *buckets = calloc(num, sizeof(INODE));
+    if(!buckets)
+      return;
+    free(data->buckets);
+    data->buckets = buckets;
+    data->num_buckets = num;
+    INODE i;
+    for(i = 1; i < data->next; i++)
+    {
+      fat_inode_t *in = data->inodes[i - 1];
+      if(in->dir_index == FAT_NO_ENTRY)
+        continue;
+      unsigned int h = fat_entry_hash(data, in->dir_cluster, in->dir_index);
+      in->hash_next = data->buckets[h];
+      data->buckets[h] = i;
+    }
+  }
+
+  inode->dir_cluster = dir_cluster;
+  inode->dir_index = dir_index;
+  unsigned int h = fat_entry_hash(data, dir_cluster, dir_index);
+  inode->hash_next = data->buckets[h];
+  data->buckets[h] = ino;
+  data->num_hashed++;
+}
+
+fat_extent_t *fat_get_extents(struct fs_st *fs, fat_inode_t *inode)
+{
+  // Returns the cluster runs of a file, walking the chain only if they
+  // are not cached
+  if(inode->extents)
+    return inode->extents;
+
+  uint32_t max = 4;
+  fat_extent_t *extents = calloc(max, sizeof(fat_extent_t));
+  uint32_t count = 0, clusters = 0;
+  // The FAT12/16 root directory has no clusters, and empty files
+  // have cluster 0
   uint32_t cluster = inode->cluster;
-  while(cluster < FAT_END)
+  while(cluster >= 2 && cluster < FAT_END)
   {
-    ret++;
+    if(count && extents[count-1].start + extents[count-1].length == cluster)
+    {
+      extents[count-1].length++;
+    } else {
+      if(count == max)
+      {
+        max *= 2;
+        extents = realloc(extents, max*sizeof(fat_extent_t));
+      }
+      extents[count].first = clusters;
+      extents[count].start = cluster;
+      extents[count].length = 1;
+      count++;
+    }
+    clusters++;
+    // Guard against loops in a broken FAT
+    if(clusters > fat_num_clusters(fs))
+      break;
     cluster = fat_read_fat(fs, cluster);
   }
-  return ret;
+
+  inode->extents = extents;
+  inode->num_extents = count;
+  inode->num_clusters = clusters;
+  return extents;
+}
+
+void fat_drop_extents(struct fs_st *fs, INODE ino)
+{
+  // Call when the cluster chain of a file has changed
+  fat_inode_t *inode = fat_get_inode(fs, ino);
+  if(!inode)
+    return;
+  free(inode->extents);
+  inode->extents = 0;
+  inode->num_extents = 0;
+  inode->num_clusters = 0;
+}
+
+uint32_t fat_find_extent(fat_inode_t *inode, uint32_t index)
+{
+  // Binary search for the extent holding cluster number index of the
+  // file. The extents must have been built with fat_get_extents()
+  uint32_t low = 0, high = inode->num_extents;
+  while(high - low > 1)
+  {
+    uint32_t mid = low + (high - low)/2;
+    if(inode->extents[mid].first <= index)
+      low = mid;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+size_t fat_io_clusters(struct fs_st *fs, fat_inode_t *inode, void *buffer, uint32_t index, uint32_t count, int write)
+{
+  // Read or write count clusters of a file starting with cluster number
+  // index, with one call per run of consecutive clusters. Clusters past
+  // the end of the chain are skipped when writing and read as zeros.
+  fat_extent_t *extents = fat_get_extents(fs, inode);
+  uint32_t have = count;
+  if(index >= inode->num_clusters)
+    have = 0;
+  else if(index + count > inode->num_clusters)
+    have = inode->num_clusters - index;
+  if(!write && have < count)
+    memset((void *)((size_t)buffer + ((size_t)have << fat_cluster_shift(fs))), 0, \
+        (size_t)(count - have) << fat_cluster_shift(fs));
+  if(!have)
+    return 0;
+  uint32_t e = fat_find_extent(inode, index);
+  uint32_t done = 0;
+  while(done < have)
+  {
+    uint32_t skip = index + done - extents[e].first;
+    uint32_t n = extents[e].length - skip;
+    if(n > have - done)
+      n = have - done;
+    void *b = (void *)((size_t)buffer + ((size_t)done << fat_cluster_shift(fs)));
+    if(write)
+      fat_writeclusters(fs, b, extents[e].start + skip, n);
+    else
+      fat_readclusters(fs, b, extents[e].start + skip, n);
+    done += n;
+    e++;
+  }
+  return done;
 }
 
-uint32_t *fat_get_clusters(struct fs_st *fs, INODE ino)
+uint32_t fat_clustercount(struct fs_st *fs, INODE ino)
 {
   if(!fs)
     return 0;
   if(!ino)
     return 0;
 
-  uint32_t c_count = fat_clustercount(fs, ino);
-  uint32_t *clusters = calloc(c_count + 1, sizeof(uint32_t));
+  fat_inode_t *inode = fat_get_inode(fs, ino);
+  if(!inode)
+    return 0;
+  fat_get_extents(fs, inode);
+  return inode->num_clusters;
+}
+
+uint32_t fat_dir_size(struct fs_st *fs, INODE dir)
+{
+  // Size in bytes of the space allocated to a directory
+  if(dir == 1 && fat_bits(fs) != 32)
+    return fat_root_sectors(fs)*fat_bpb(fs)->bytes_per_sector;
+  return fat_clustercount(fs, dir)*fat_clustersize(fs);
+}
+
+size_t fat_read_root(struct fs_st *fs, void *buffer, size_t length, uint64_t offset)
+{
+  // The FAT12/16 root directory is a fixed area before the first
+  // data cluster
+  uint32_t size = fat_dir_size(fs, 1);
+  if(offset >= size)
+    return 0;
+  if(offset + length > size)
+    length = size - offset;
 
-  uint32_t i = 0;
-  if(ino == 1)
+  void *root = malloc(size);
+  if(!partition_readblocks(fs->p, root, fat_root_start(fs), fat_root_sectors(fs)))
   {
-    while(i < c_count)
-    {
-      clusters[i] = i;
-      i++;
-    }
-  } else {
-    fat_inode_t *inode = fat_get_inode(fs, ino);
-    uint32_t cluster = inode->cluster;
-    while(i < c_count)
-    {
-      clusters[i] = cluster;
-      cluster = fat_read_fat(fs, cluster);
-      i++;
-    }
+    free(root);
+    return 0;
+  }
+  memcpy(buffer, (void *)((size_t)root + offset), length);
+  free(root);
+  return length;
+}
+
+size_t fat_write_root(struct fs_st *fs, void *buffer, size_t length, uint64_t offset)
+{
+  uint32_t size = fat_dir_size(fs, 1);
+  if(offset >= size)
+    return 0;
+  if(offset + length > size)
+    length = size - offset;
+
+  void *root = malloc(size);
+  if(!partition_readblocks(fs->p, root, fat_root_start(fs), fat_root_sectors(fs)))
+  {
+    free(root);
+    return 0;
   }
-  return clusters;
+  memcpy((void *)((size_t)root + offset), buffer, length);
+  if(!partition_writeblocks(fs->p, root, fat_root_start(fs), fat_root_sectors(fs)))
+    length = 0;
+  free(root);
+  return length;
 }
 
 char *fat_read_longname(void *de)
@@ -266,38 +882,45 @@ uint8_t fat_checksum(const char *shortname)
   return sum;
 }
 
+char fat_shortname_char(char c)
+{
+  // How a character of a long name appears in the 8.3 name. Spaces and
+  // dots are left out (0), characters not allowed there become _.
+  if(c == ' ' || c == '.')
+    return 0;
+  if(isalnum((unsigned char)c))
+    return toupper((unsigned char)c);
+  if((unsigned char)c < 0x80 && strchr("!#$%&'()-@^_`{}~", c))
+    return c;
+  return '_';
+}
+
 char *fat_make_shortname(const char *longname)
 {
+  // Basis of the 8.3 name for a long name, upper case and padded with
+  // spaces. fat_link() adds a ~N tail if it is not the same name or is
+  // already taken.
   if(!longname)
     return 0;
 
-  char *shortname = calloc(11, 1);
+  char *shortname = malloc(12);
+  memset(shortname, ' ', 11);
+  shortname[11] = '\0';
 
-  // Copy first 8 characters
-  strncpy(shortname, longname, 8);
+  // The extension is after the last dot, unless that starts the name
+  const char *dot = strrchr(longname, '.');
+  if(dot == longname)
+    dot = 0;
+  const char *c;
+  char sc;
   int i = 0;
-
-  // Break string at the first .
-  char *dot =strchr(shortname, '.');
+  for(c = longname; *c && c != dot && i < 8; c++)
+    if((sc = fat_shortname_char(*c)))
+      shortname[i++] = sc;
   if(dot)
-  {
-    dot[0] = '\0';
-  }
-
-  // Pad with spaces
-  i = strlen(shortname);
-  while(i < 8)
-    shortname[i++] = ' ';
-
-  // Find and copy extension
-  dot = strrchr(longname, '.');
-  if(dot)
-    strncpy(&shortname[8], &dot[1], 3);
-
-  // Pad with spaces
-  i = strlen(shortname);
-  while(i < 11)
-    shortname[i++] = ' ';
+    for(c = dot + 1, i = 8; *c && i < 11; c++)
+      if((sc = fat_shortname_char(*c)))
+        shortname[i++] = sc;
 
   return shortname;
 }
@@ -359,7 +982,56 @@ void *fat_write_longname(void *de, const char *name)
 
 
 
-int fat_read(struct fs_st *fs, INODE ino, void *buffer, size_t length, size_t offset)
+uint64_t fat_offset_sector(struct fs_st *fs, INODE ino, uint64_t offset)
+{
+  // Sector holding a byte of a file, or 0 if it is past the allocated
+  // space
+  if(ino == 1 && fat_bits(fs) != 32)
+  {
+    if(offset >= (uint64_t)fat_root_sectors(fs)*BLOCK_SIZE)
+      return 0;
+    return fat_root_start(fs) + offset/BLOCK_SIZE;
+  }
+
+  fat_inode_t *inode = fat_get_inode(fs, ino);
+  if(!inode)
+    return 0;
+  fat_extent_t *extents = fat_get_extents(fs, inode);
+  uint32_t index = offset >> fat_cluster_shift(fs);
+  if(index >= inode->num_clusters)
+    return 0;
+  fat_extent_t *e = &extents[fat_find_extent(inode, index)];
+  uint32_t cluster = e->start + index - e->first;
+  return fat_data_start(fs) + (uint64_t)(cluster - 2)*fat_geo(fs)->cluster_sectors \
+    + (offset & (fat_clustersize(fs) - 1))/BLOCK_SIZE;
+}
+
+size_t fat_write_sectors(struct fs_st *fs, INODE ino, void *buffer, size_t length, uint64_t offset)
+{
+  // Write a small part of a file, like a few directory entries, by
+  // rewriting only the sectors it is in. Doesn't look at the file size.
+  uint8_t *sector = malloc(BLOCK_SIZE);
+  size_t done = 0;
+  while(done < length)
+  {
+    uint64_t lba = fat_offset_sector(fs, ino, offset + done);
+    if(!lba)
+      break;
+    size_t start = (offset + done)%BLOCK_SIZE;
+    size_t n = BLOCK_SIZE - start;
+    if(n > length - done)
+      n = length - done;
+    if(n < BLOCK_SIZE)
+      partition_readblocks(fs->p, sector, lba, 1);
+    memcpy(sector + start, (uint8_t *)buffer + done, n);
+    partition_writeblocks(fs->p, sector, lba, 1);
+    done += n;
+  }
+  free(sector);
+  return done;
+}
+
+size_t fat_read(struct fs_st *fs, INODE ino, void *buffer, size_t length, uint64_t offset)
 {
   if(!fs)
     return 0;
@@ -370,40 +1042,65 @@ int fat_read(struct fs_st *fs, INODE ino, void *buffer, size_t length, size_t of
   if(!length)
     return 0;
 
+  if(ino == 1 && fat_bits(fs) != 32)
+    return fat_read_root(fs, buffer, length, offset);
+
   fat_inode_t *inode = fat_get_inode(fs, ino);
-  uint32_t *clusters = fat_get_clusters(fs, ino);
-  uint32_t size = inode->size;
+  if(!inode)
+    return 0;
+  fat_get_extents(fs, inode);
+  uint64_t size = inode->size;
   if(!size) // size=0 ==> Probably a directory
-    size = fat_clustercount(fs, ino)*fat_clustersize(fs);
+    size = (uint64_t)inode->num_clusters << fat_cluster_shift(fs);
 
+  if(offset >= size)
+    return 0;
   if(offset + length > size)
     length = size - offset;
 
-  uint32_t start_cluster = offset/(fat_clustersize(fs));
-  uint32_t cluster_offset = offset%(fat_clustersize(fs));
-  uint32_t num_clusters = (length+cluster_offset)/(fat_clustersize(fs));
-  if((length+cluster_offset)%(fat_clustersize(fs)))
-    num_clusters++;
-
-  // This can be optimized memory-wise.
-  void *buff = 0;
-  void *b = buff = calloc(1, num_clusters*fat_clustersize(fs));
-  uint32_t i = start_cluster;
-  while( i < (start_cluster + num_clusters))
+  int shift = fat_cluster_shift(fs);
+  uint32_t cluster_size = fat_clustersize(fs);
+  uint32_t cluster = offset >> shift;
+  uint32_t cluster_offset = offset & (cluster_size - 1);
+  uint8_t *out = buffer;
+  size_t left = length;
+
+  // Partial clusters at the start and end go through a bounce buffer,
+  // whole clusters are read straight into the caller's buffer
+  uint8_t *bounce = 0;
+  if(cluster_offset || left < cluster_size)
   {
-    fat_readclusters(fs, b, clusters[i], 1);
-    b = (void *)((size_t)b + fat_clustersize(fs));
-    i++;
+    bounce = malloc(cluster_size);
+    size_t n = cluster_size - cluster_offset;
+    if(n > left)
+      n = left;
+    fat_io_clusters(fs, inode, bounce, cluster, 1, 0);
+    memcpy(out, bounce + cluster_offset, n);
+    out += n;
+    left -= n;
+    cluster++;
+  }
+  uint32_t whole = left >> shift;
+  if(whole)
+  {
+    fat_io_clusters(fs, inode, out, cluster, whole, 0);
+    out += (size_t)whole << shift;
+    left -= (size_t)whole << shift;
+    cluster += whole;
+  }
+  if(left)
+  {
+    if(!bounce)
+      bounce = malloc(cluster_size);
+    fat_io_clusters(fs, inode, bounce, cluster, 1, 0);
+    memcpy(out, bounce, left);
   }
 
-  memcpy(buffer, (void *)((size_t)buff + cluster_offset), length);
-
-  free(clusters);
-  free(buff);
+  free(bounce);
   return length;
 }
 
-int fat_write(struct fs_st *fs, INODE ino, void *buffer, size_t length, size_t offset)
+size_t fat_write(struct fs_st *fs, INODE ino, void *buffer, size_t length, uint64_t offset)
 {
   if(!fs)
     return 0;
@@ -412,50 +1109,83 @@ int fat_write(struct fs_st *fs, INODE ino, void *buffer, size_t length, size_t o
   if(!buffer)
     return 0;
 
+  if(ino == 1 && fat_bits(fs) != 32)
+    return fat_write_root(fs, buffer, length, offset);
+
   fat_inode_t *inode = fat_get_inode(fs, ino);
-  uint32_t *clusters = fat_get_clusters(fs, ino);
-  uint32_t size = inode->size;
+  if(!inode)
+    return 0;
+  fat_get_extents(fs, inode);
+  uint64_t size = inode->size;
   if(!size)
-    size = fat_clustercount(fs, ino)*fat_clustersize(fs);
+    size = (uint64_t)inode->num_clusters << fat_cluster_shift(fs);
 
+  if(offset >= size)
+    return 0;
   if(offset + length > size)
     length = size - offset;
 
-  uint32_t start_cluster = offset/(fat_clustersize(fs));
-  uint32_t cluster_offset = offset%(fat_clustersize(fs));
-  uint32_t num_clusters = (length+cluster_offset)/(fat_clustersize(fs));
-  if((length+cluster_offset)%(fat_clustersize(fs)))
-    num_clusters++;
-
-  void *buff = 0;
-  void *b = buff = calloc(1, num_clusters*fat_clustersize(fs));
-  fat_read(fs, ino, buff, num_clusters*fat_clustersize(fs), offset - cluster_offset);
-  memcpy((void *)((size_t)buff + cluster_offset), buffer, length);
-  uint32_t i = start_cluster;
-  while( i < (start_cluster + num_clusters))
-  {
-    fat_writeclusters(fs, b, clusters[i], 1);
-    b = (void *)((size_t)b + fat_clustersize(fs));
-    i++;
+  int shift = fat_cluster_shift(fs);
+  uint32_t cluster_size = fat_clustersize(fs);
+  uint32_t cluster = offset >> shift;
+  uint32_t cluster_offset = offset & (cluster_size - 1);
+  uint8_t *in = buffer;
+  size_t left = length;
+
+  // Only partial clusters at the start and end are read, patched and
+  // written back. Whole clusters are written straight from the caller's
+  // buffer.
+  uint8_t *bounce = 0;
+  if(cluster_offset || left < cluster_size)
+  {
+    bounce = malloc(cluster_size);
+    size_t n = cluster_size - cluster_offset;
+    if(n > left)
+      n = left;
+    fat_io_clusters(fs, inode, bounce, cluster, 1, 0);
+    memcpy(bounce + cluster_offset, in, n);
+    fat_io_clusters(fs, inode, bounce, cluster, 1, 1);
+    in += n;
+    left -= n;
+    cluster++;
+  }
+  uint32_t whole = left >> shift;
+  if(whole)
+  {
+    fat_io_clusters(fs, inode, in, cluster, whole, 1);
+    in += (size_t)whole << shift;
+    left -= (size_t)whole << shift;
+    cluster += whole;
+  }
+  if(left)
+  {
+    if(!bounce)
+      bounce = malloc(cluster_size);
+    fat_io_clusters(fs, inode, bounce, cluster, 1, 0);
+    memcpy(bounce, in, left);
+    fat_io_clusters(fs, inode, bounce, cluster, 1, 1);
   }
 
-  free(clusters);
-  free(buff);
+  free(bounce);
   return length;
 }
 
-INODE fat_touch(struct fs_st *fs, fstat_t *st)
+INODE fat_touch(struct fs_st *fs, fstat_t *st, INODE dir)
 {
   if(!fs)
     return 0;
   if(!st)
     return 0;
+  if(st->size > 0xFFFFFFFF) // FAT file sizes are 32 bit
+    return 0;
+  uint64_t needed = (st->size + fat_clustersize(fs) - 1) >> fat_cluster_shift(fs);
+  if(needed > fat_free_data(fs)->num_free || !fat_data(fs)->num_free)
+    return 0;
 
   // Create inode
-  INODE ret = fat_data(fs)->next++;
   fat_inode_t *ino = calloc(1, sizeof(fat_inode_t));
 
-  ino->parent = -1;
+  ino->parent = dir?dir:(INODE)-1;
   if((st->mode & S_DIR) == S_DIR)
     ino->type = FAT_DIR_DIRECTORY;
   ino->atime = st->atime;
@@ -463,25 +1193,476 @@ INODE fat_touch(struct fs_st *fs, fstat_t *st)
   ino->mtime = st->mtime;
   ino->size = st->size;
 
-  // Allocate clusters
-  int32_t size = ino->size - fat_clustersize(fs);
-  uint32_t current = ino->cluster = fat_find_free(fs);
-  fat_write_fat(fs, current, FAT_END);
-  while(size >0)
-  {
-    fat_write_fat(fs, current, fat_find_free(fs));
-    current = fat_read_fat(fs, current);
-    fat_write_fat(fs, current, FAT_END);
-    if(fat_clustersize(fs) > size)
-      size = 0;
+  // Allocate clusters, as one contiguous run if possible. Files always
+  // get at least one cluster.
+  uint32_t left = needed?needed:1;
+  uint32_t last = 0;
+  while(left)
+  {
+    uint32_t length;
+    uint32_t start = fat_find_best_run(fs, left, &length);
+    if(!start)
+      break;
+    if(length > left)
+      length = left;
+    if(last)
+      fat_write_fat(fs, last, start);
     else
-      size -= fat_clustersize(fs);
+      ino->cluster = start;
+    fat_link_run(fs, start, length);
+    last = start + length - 1;
+    left -= length;
+  }
+
+  return fat_add_inode(fs, ino);
+}
+
+uint32_t fat_decode_time(uint16_t date, uint16_t time)
+{
+  // Seconds since the epoch from a FAT date and time
+  const uint16_t days_before[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+  if(!date)
+    return 0;
+
+  uint32_t year = 1980 + (date >> 9);
+  uint32_t month = (date >> 5) & 0xF;
+  uint32_t day = date & 0x1F;
+  if(month < 1 || month > 12)
+    month = 1;
+  if(day < 1)
+    day = 1;
+
+  // Leap days between 1970 and the start of the year
+  uint32_t leap = ((year - 1)/4 - 1969/4) - ((year - 1)/100 - 1969/100) \
+    + ((year - 1)/400 - 1969/400);
+  uint32_t days = (year - 1970)*365 + leap + days_before[month - 1] + day - 1;
+  if(month > 2 && (!(year%4) && ((year%100) || !(year%400))))
+    days++;
+
+  return days*86400 + (time >> 11)*3600 + ((time >> 5) & 0x3F)*60 + (time & 0x1F)*2;
+}
+
+uint16_t fat_encode_date(uint32_t t)
+{
+  // FAT dates start in 1980
+  time_t tt = (t < 315532800)?315532800:t;
+  struct tm *tm = gmtime(&tt);
+  return (((tm->tm_year - 80) & 0x7F) << 9) | (((tm->tm_mon + 1) & 0xF) << 5) | (tm->tm_mday & 0x1F);
+}
+
+uint16_t fat_encode_time(uint32_t t)
+{
+  time_t tt = (t < 315532800)?315532800:t;
+  struct tm *tm = gmtime(&tt);
+  return ((tm->tm_hour & 0x1F) << 11) | ((tm->tm_min & 0x3F) << 5) | ((tm->tm_sec/2) & 0x1F);
+}
+
+void fat_format_shortname(const uint8_t *raw, char *name)
+{
+  // Turn the 11 characters of an 8.3 name into NAME.EXT
+  char *c = name;
+  int i;
+  for(i = 0; i < 8 && raw[i] != ' '; i++)
+    *c++ = raw[i];
+  if(raw[8] != ' ')
+    *c++ = '.';
+  for(i = 8; i < 11 && raw[i] != ' '; i++)
+    *c++ = raw[i];
+  *c = '\0';
+}
+
+fat_entry_t *fat_get_entries(struct fs_st *fs, INODE dir)
+{
+  // Returns the parsed entries of a directory, reading and parsing the
+  // directory only if they are not cached
+  fat_inode_t *dir_ino = fat_get_inode(fs, dir);
+  if(!dir_ino)
+    return 0;
+  if(dir_ino->entries)
+    return dir_ino->entries;
+
+  uint32_t size = fat_dir_size(fs, dir);
+  void *buffer = calloc(1, size);
+  fat_read(fs, dir, buffer, size, 0);
+  uint32_t max = 16;
+  fat_entry_t *entries = calloc(max, sizeof(fat_entry_t));
+  uint32_t count = 0;
+
+  uint32_t max_free = 4;
+  fat_slots_t *free_slots = calloc(max_free, sizeof(fat_slots_t));
+  uint32_t num_free = 0;
+  uint32_t used = 0; // Slot after the last entry seen
+
+  fat_dir_t *de = buffer;
+  fat_dir_t *end = (fat_dir_t *)((size_t)buffer + size);
+  while(de < end && de->name[0] != 0)
+  {
+    if(de->name[0] == 0xE5)
+    {
+      // Deleted entry
+      de++;
+      continue;
+    }
+    // Read longname and skip longname entries
+    fat_dir_t *first = de;
+    char *longname = 0;
+    if(de->attrib == FAT_DIR_LONGNAME)
+      longname = fat_read_longname(de);
+    while(de < end && de->attrib == FAT_DIR_LONGNAME)
+      de++;
+    if(de >= end || de->name[0] == 0)
+    {
+      free(longname);
+      break;
+    }
+
+    if(count == max)
+    {
+      max *= 2;
+      entries = realloc(entries, max*sizeof(fat_entry_t));
+    }
+    fat_entry_t *e = &entries[count++];
+    fat_format_shortname(de->name, e->shortname);
+    e->name = longname?longname:strdup(e->shortname);
+    e->attrib = de->attrib;
+    e->cluster = (de->cluster_high << 16) + de->cluster_low;
+    e->size = de->size;
+    e->atime = fat_decode_time(de->adate, 0);
+    e->ctime = fat_decode_time(de->cdate, de->ctime);
+    e->mtime = fat_decode_time(de->mdate, de->mtime);
+    e->first = first - (fat_dir_t *)buffer;
+    e->index = de - (fat_dir_t *)buffer;
+    de++;
+
+    // Slots between this entry and the one before are free
+    if(e->first > used)
+    {
+      if(num_free == max_free)
+      {
+        max_free *= 2;
+        free_slots = realloc(free_slots, max_free*sizeof(fat_slots_t));
+      }
+      free_slots[num_free].start = used;
+      free_slots[num_free].length = e->first - used;
+      num_free++;
+    }
+    used = e->index + 1;
+  }
+  // Deleted entries at the end are left to be reused by appending
+  dir_ino->end_slot = used;
+
+  free(buffer);
+  dir_ino->entries = entries;
+  dir_ino->num_entries = count;
+  dir_ino->max_entries = max;
+  dir_ino->free_slots = free_slots;
+  dir_ino->num_free_slots = num_free;
+  return entries;
+}
+
+void fat_drop_entries(struct fs_st *fs, INODE dir)
+{
+  // Call when a directory has been written to
+  fat_inode_t *dir_ino = fat_get_inode(fs, dir);
+  if(!dir_ino || !dir_ino->entries)
+    return;
+  uint32_t i;
+  for(i = 0; i < dir_ino->num_entries; i++)
+    free(dir_ino->entries[i].name);
+  free(dir_ino->entries);
+  dir_ino->entries = 0;
+  dir_ino->num_entries = 0;
+  dir_ino->max_entries = 0;
+  free(dir_ino->free_slots);
+  dir_ino->free_slots = 0;
+  dir_ino->num_free_slots = 0;
+  free(dir_ino->name_buckets);
+  dir_ino->name_buckets = 0;
+  dir_ino->num_name_buckets = 0;
+}
+
+uint32_t fat_name_hash(const char *name)
+{
+  // FNV-1a of the name folded to upper case
+  uint32_t h = 2166136261u;
+  for(; *name; name++)
+    h = (h ^ (uint8_t)toupper((unsigned char)*name))*16777619u;
+  return h;
+}
+
+void fat_hash_name(fat_inode_t *dir_ino, fat_entry_t *e)
+{
+  // Add an entry to the name hash of its directory, by short name and
+  // by long name if it has one
+  uint32_t mask = dir_ino->num_name_buckets - 1;
+  uint32_t h = fat_name_hash(e->shortname) & mask;
+  e->hash_next[1] = dir_ino->name_buckets[h];
+  dir_ino->name_buckets[h] = e->index*2 + 1;
+  e->hash_next[0] = FAT_NO_ENTRY;
+  if(strcasecmp(e->name, e->shortname))
+  {
+    h = fat_name_hash(e->name) & mask;
+    e->hash_next[0] = dir_ino->name_buckets[h];
+    dir_ino->name_buckets[h] = e->index*2;
+  }
+}
+
+void fat_build_names(fat_inode_t *dir_ino)
+{
+  // (Re)build the name hash of a directory from its cached entries
+  uint32_t num = 16;
+  while(num < dir_ino->num_entries*2)
+    num *= 2;
+  free(dir_ino->name_buckets);
+  dir_ino->name_buckets = malloc(num*sizeof(uint32_t));
+  memset(dir_ino->name_buckets, 0xFF, num*sizeof(uint32_t));
+  dir_ino->num_name_buckets = num;
+  uint32_t i;
+  for(i = 0; i < dir_ino->num_entries; i++)
+    fat_hash_name(dir_ino, &dir_ino->entries[i]);
+}
+
+fat_entry_t *fat_find_cached(fat_inode_t *dir_ino, uint32_t index)
+{
+  // Binary search the cached entries of a directory for the one whose
+  // short entry is at slot index
+  uint32_t low = 0, high = dir_ino->num_entries;
+  while(low < high)
+  {
+    uint32_t mid = low + (high - low)/2;
+    if(dir_ino->entries[mid].index == index)
+      return &dir_ino->entries[mid];
+    if(dir_ino->entries[mid].index < index)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return 0;
+}
+
+void fat_unhash_name(fat_inode_t *dir_ino, fat_entry_t *e)
+{
+  // Remove an entry from the name hash of its directory
+  int k;
+  for(k = 0; k < 2; k++)
+  {
+    if(!k && !strcasecmp(e->name, e->shortname))
+      continue; // No long name was hashed
+    uint32_t key = e->index*2 + k;
+    uint32_t *link = &dir_ino->name_buckets[fat_name_hash(k?e->shortname:e->name) \
+      & (dir_ino->num_name_buckets - 1)];
+    while(*link != FAT_NO_ENTRY)
+    {
+      if(*link == key)
+      {
+        *link = e->hash_next[k];
+        break;
+      }
+      fat_entry_t *next = fat_find_cached(dir_ino, *link/2);
+      if(!next)
+        break;
+      link = &next->hash_next[*link & 1];
+    }
+  }
+}
+
+void fat_free_slots(fat_inode_t *dir_ino, uint32_t start, uint32_t end)
+{
+  // Add the slots [start, end) to the free slots of a directory, merging
+  // them with the holes around them. Slots after the last entry are
+  // given back to the end of the directory instead.
+  if(end >= dir_ino->end_slot)
+  {
+    uint32_t n = dir_ino->num_entries;
+    dir_ino->end_slot = n?dir_ino->entries[n - 1].index + 1:0;
+    while(dir_ino->num_free_slots \
+        && dir_ino->free_slots[dir_ino->num_free_slots - 1].start >= dir_ino->end_slot)
+      dir_ino->num_free_slots--;
+    return;
+  }
+
+  fat_slots_t *slots = dir_ino->free_slots;
+  uint32_t r = 0;
+  while(r < dir_ino->num_free_slots && slots[r].start < start)
+    r++;
+  int before = r > 0 && slots[r - 1].start + slots[r - 1].length == start;
+  int after = r < dir_ino->num_free_slots && slots[r].start == end;
+  if(before && after)
+  {
+    slots[r - 1].length += end - start + slots[r].length;
+    dir_ino->num_free_slots--;
+    memmove(&slots[r], &slots[r + 1], (dir_ino->num_free_slots - r)*sizeof(fat_slots_t));
+  } else if(before) {
+    slots[r - 1].length += end - start;
+  } else if(after) {
+    slots[r].start = start;
+    slots[r].length += end - start;
+  } else {
+    slots = dir_ino->free_slots = realloc(slots, \
+        (dir_ino->num_free_slots + 1)*sizeof(fat_slots_t));
+    memmove(&slots[r + 1], &slots[r], (dir_ino->num_free_slots - r)*sizeof(fat_slots_t));
+    slots[r].start = start;
+    slots[r].length = end - start;
+    dir_ino->num_free_slots++;
+  }
+}
+
+int fat_write_entry(struct fs_st *fs, INODE ino)
+{
+  // Update the size and first cluster in the directory entry of a
+  // linked file. Files that are not linked yet get them written by
+  // fat_link()
+  fat_inode_t *inode = fat_get_inode(fs, ino);
+  if(!inode)
+    return 1;
+  if(inode->dir_index == FAT_NO_ENTRY)
+    return 0;
+
+  fat_dir_t de;
+  uint64_t offset = (uint64_t)inode->dir_index*sizeof(fat_dir_t);
+  if(fat_read(fs, inode->parent, &de, sizeof(fat_dir_t), offset) != sizeof(fat_dir_t))
+    return 1;
+  de.size = inode->size;
+  de.cluster_high = inode->cluster >> 16;
+  de.cluster_low = inode->cluster & 0xFFFF;
+  if(fat_write_sectors(fs, inode->parent, &de, sizeof(fat_dir_t), offset) != sizeof(fat_dir_t))
+    return 1;
+
+  fat_inode_t *dir_ino = fat_get_inode(fs, inode->parent);
+  fat_entry_t *e = dir_ino?fat_find_cached(dir_ino, inode->dir_index):0;
+  if(e)
+  {
+    e->size = inode->size;
+    e->cluster = inode->cluster;
+  }
+  return 0;
+}
+
+int fat_fallocate(struct fs_st *fs, INODE ino, uint64_t offset, uint64_t length)
+{
+  if(!fs)
+    return 1;
+  if(ino < 2) // The FAT12/16 root directory has a fixed size
+    return 1;
+
+  fat_inode_t *inode = fat_get_inode(fs, ino);
+  if(!inode)
+    return 1;
+  if(inode->type == FAT_DIR_DIRECTORY)
+    return 1;
+  uint64_t new_size = offset + length;
+  if(new_size > 0xFFFFFFFF) // FAT file sizes are 32 bit
+    return 1;
+  if(new_size <= inode->size)
+    return 0;
+
+  // Link a contiguous run of free clusters to the end of the chain if
+  // one is available, otherwise take free clusters one by one
+  uint32_t have = fat_clustercount(fs, ino);
+  uint32_t want = (new_size + fat_clustersize(fs) - 1) >> fat_cluster_shift(fs);
+  // Empty files may have no clusters at all
+  uint32_t last = inode->cluster;
+  while(last >= 2 && fat_read_fat(fs, last) < FAT_END)
+    last = fat_read_fat(fs, last);
+  uint32_t tail = last;
+  uint32_t count = (want > have)?want - have:0;
+  uint32_t run = fat_find_free_run(fs, count);
+  uint32_t current, i;
+  for(i = 0; i < count; i++)
+  {
+    if(run)
+      current = run + i;
+    else
+      current = fat_find_free(fs);
+    if(!current)
+      break;
+    if(last >= 2)
+      fat_write_fat(fs, last, current);
+    else
+      inode->cluster = current;
+    fat_write_fat(fs, current, FAT_EOC);
+    last = current;
+  }
+  if(i < count)
+  {
+    // Out of space, give back what was taken
+    if(tail >= 2)
+    {
+      current = fat_read_fat(fs, tail);
+      fat_write_fat(fs, tail, FAT_EOC);
+    } else {
+      current = inode->cluster;
+      inode->cluster = tail;
+    }
+    while(current >= 2 && current < FAT_END)
+    {
+      last = fat_read_fat(fs, current);
+      fat_write_fat(fs, current, 0);
+      current = last;
+    }
+    fat_drop_extents(fs, ino);
+    return 1;
+  }
+  fat_drop_extents(fs, ino);
+
+  // Clear everything past the old end of the file
+  uint32_t old_size = inode->size;
+  inode->size = new_size;
+  uint64_t end = (uint64_t)have*fat_clustersize(fs);
+  if(end > new_size)
+    end = new_size;
+  if(end > old_size)
+  {
+    void *zero = calloc(1, end - old_size);
+    fat_write(fs, ino, zero, end - old_size, old_size);
+    free(zero);
+  }
+  if(count)
+  {
+    fat_extent_t *extents = fat_get_extents(fs, inode);
+    void *zero = calloc(1, fat_clustersize(fs));
+    uint32_t e;
+    for(e = fat_find_extent(inode, have); e < inode->num_extents; e++)
+    {
+      uint32_t skip = (extents[e].first < have)?have - extents[e].first:0;
+      uint32_t start = extents[e].start + skip;
+      uint32_t length = extents[e].length - skip;
+      uint64_t sector = fat_data_start(fs) + (uint64_t)(start - 2)*fat_geo(fs)->cluster_sectors;
+      if(!partition_discardblocks(fs->p, sector, (uint64_t)length*fat_geo(fs)->cluster_sectors))
+      {
+        for(i = 0; i < length; i++)
+          fat_writeclusters(fs, zero, start + i, 1);
+      }
+    }
+    free(zero);
   }
 
-  fat_data(fs)->last->next = ino;
-  fat_data(fs)->last = ino;
+  return fat_write_entry(fs, ino);
+}
 
-  return ret;
+INODE fat_entry_inode(struct fs_st *fs, INODE dir, fat_entry_t *e)
+{
+  // Returns the inode of a directory entry, reusing it if the entry has
+  // been seen before
+  fat_inode_t *dir_ino = fat_get_inode(fs, dir);
+  INODE ino;
+  if((ino = fat_find_entry(fs, dir_ino->cluster, e->index)))
+    return ino;
+
+  // Build inode
+  fat_inode_t *inode = calloc(1, sizeof(fat_inode_t));
+  inode->parent = dir;
+  inode->type = e->attrib;
+  inode->cluster = e->cluster;
+  inode->size = e->size;
+  inode->atime = e->atime;
+  inode->ctime = e->ctime;
+  inode->mtime = e->mtime;
+
+  // Insert new inode into table
+  ino = fat_add_inode(fs, inode);
+  fat_hash_entry(fs, ino, dir_ino->cluster, e->index);
+  return ino;
 }
 
 dirent_t *fat_readdir(struct fs_st *fs, INODE dir, unsigned int num)
@@ -512,143 +1693,281 @@ dirent_t *fat_readdir(struct fs_st *fs, INODE dir, unsigned int num)
     ret->name = strdup("..");
     ret->ino = dir_ino->parent;
     return ret;
-  } else { // Other entries
+  }
+
+  // Other entries. Directories other than the root start with . and ..
+  // on disk, which are skipped
+  fat_entry_t *entries = fat_get_entries(fs, dir);
+  if(!entries)
+    return 0;
+  if(dir == 1)
+    num -= 2;
+  if(num >= dir_ino->num_entries)
+    return 0;
+  fat_entry_t *e = &entries[num];
 
-    if(dir != 1)
-      num +=2; // Skip . and ..
+  dirent_t *ret = calloc(1, sizeof(dirent_t));
+  ret->name = strdup(e->name);
+  ret->ino = fat_entry_inode(fs, dir, e);
+  return ret;
+}
 
-    // Read directory entries
-    uint32_t size = fat_clustercount(fs, dir)*fat_clustersize(fs);
-    void *buffer = calloc(1, size);
-    size_t max = (size_t)buffer + size;
-    fat_read(fs, dir, buffer, size, 0);
+fat_entry_t *fat_name_taken(fat_inode_t *dir_ino, const char *name)
+{
+  // Returns an entry of a directory whose long or 8.3 name is name,
+  // ignoring case. The name hash has to be built.
+  uint32_t item = dir_ino->name_buckets[fat_name_hash(name) & (dir_ino->num_name_buckets - 1)];
+  while(item != FAT_NO_ENTRY)
+  {
+    fat_entry_t *e = fat_find_cached(dir_ino, item/2);
+    if(!e)
+      break;
+    if(!strcasecmp(name, (item & 1)?e->shortname:e->name))
+      return e;
+    item = e->hash_next[item & 1];
+  }
+  return 0;
+}
 
-    fat_dir_t *de = buffer;
-    while((num > 2) && ((size_t)de < max))
+void fat_unique_shortname(fat_inode_t *dir_ino, const char *name, char *raw)
+{
+  // The 11 characters of the 8.3 name for a new entry. A ~N tail is added
+  // when the long name doesn't fit 8.3 or the name is already used in
+  // the directory. Like Windows, after ~4 the start of the name is
+  // replaced with four hex digits of a hash of the long name, so that
+  // many similar names don't have to try every number.
+  char *basis = fat_make_shortname(name);
+  char formatted[13];
+  memcpy(raw, basis, 11);
+  fat_format_shortname((uint8_t *)raw, formatted);
+  int lossy = strcasecmp(formatted, name) != 0;
+  unsigned int n = 1;
+  while(lossy || fat_name_taken(dir_ino, formatted))
+  {
+    lossy = 0;
+    if(n == 5)
     {
-      if(de->name[0] == 0)
-      {
-        // Encountered last entry
-        free(buffer);
-        return 0;
-      }
-      if(de->attrib == FAT_DIR_LONGNAME || de->name[0] == 0xE5)
-      {
-        // Skip longname entry or deleted entries
-        de++;
-      } else {
-        de++;
-        num--;
-      }
+      char hex[5];
+      sprintf(hex, "%04X", fat_name_hash(name) & 0xFFFF);
+      int base = 0;
+      while(base < 2 && basis[base] != ' ')
+        base++;
+      memset(basis + base, ' ', 8 - base);
+      memcpy(basis + base, hex, 4);
     }
-    if(de->name[0] == 0 || ((size_t)de >= max))
+    char tail[12];
+    int len = sprintf(tail, "~%u", (n < 5)?n:n - 4);
+    n++;
+    int base = 0;
+    while(base < 8 && basis[base] != ' ')
+      base++;
+    if(base > 8 - len)
+      base = 8 - len;
+    memcpy(raw, basis, 11);
+    memcpy(&raw[base], tail, len);
+    fat_format_shortname((uint8_t *)raw, formatted);
+  }
+  free(basis);
+}
+
+INODE fat_lookup(struct fs_st *fs, INODE dir, const char *name)
+{
+  // Find a name in a directory, ignoring case like FAT does. Long names
+  // are matched first, then 8.3 names if only one entry has the name.
+  if(!fs)
+    return 0;
+  if(!dir)
+    return 0;
+  if(!name)
+    return 0;
+
+  fat_inode_t *dir_ino = fat_get_inode(fs, dir);
+  if(!dir_ino)
+    return 0;
+  if(dir_ino->type != FAT_DIR_DIRECTORY)
+    return 0;
+  if(!strcmp(name, "."))
+    return dir;
+  if(!strcmp(name, ".."))
+    return dir_ino->parent;
+
+  if(!fat_get_entries(fs, dir))
+    return 0;
+  if(!dir_ino->name_buckets)
+    fat_build_names(dir_ino);
+
+  // Entries without a long name have their 8.3 name as name, so they
+  // are found here too
+  uint32_t bucket = dir_ino->name_buckets[fat_name_hash(name) & (dir_ino->num_name_buckets - 1)];
+  uint32_t item = bucket;
+  fat_entry_t *e;
+  while(item != FAT_NO_ENTRY && (e = fat_find_cached(dir_ino, item/2)))
+  {
+    if(!strcasecmp(name, e->name))
+      return fat_entry_inode(fs, dir, e);
+    item = e->hash_next[item & 1];
+  }
+
+  // Older versions of this driver gave different files the same 8.3
+  // name, such a name doesn't find anything
+  fat_entry_t *found = 0;
+  item = bucket;
+  while(item != FAT_NO_ENTRY && (e = fat_find_cached(dir_ino, item/2)))
+  {
+    if((item & 1) && !strcasecmp(name, e->shortname))
     {
-      free(buffer);
-      return 0;
+      if(found && found != e)
+        return 0;
+      found = e;
     }
+    item = e->hash_next[item & 1];
+  }
+  return found?fat_entry_inode(fs, dir, found):0;
+}
 
-    // Read longname and skip longname entries
-    char *longname = fat_read_longname(de);
-    while(de->attrib == FAT_DIR_LONGNAME) de++;
+int fat_readdir_r(struct fs_st *fs, INODE dir, unsigned int num, dirent_t *de, char *name, size_t name_size)
+{
+  // readdir() into caller buffers, the name comes from the cached entry
+  if(!fs)
+    return 1;
+  if(!dir)
+    return 1;
 
-    // Now de is the entry we want
-    dirent_t *ret = calloc(1, sizeof(dirent_t));
-    ret->ino = fat_data(fs)->next;
-    if(longname)
+  fat_inode_t *dir_ino = fat_get_inode(fs, dir);
+  if(!dir_ino || dir_ino->type != FAT_DIR_DIRECTORY)
+    return 1;
+
+  const char *src;
+  if(num < 2) // . and ..
+  {
+    de->ino = num?dir_ino->parent:dir;
+    src = num?"..":".";
+  } else {
+    if(!fat_get_entries(fs, dir))
+      return 1;
+    uint32_t index = (dir == 1)?num - 2:num;
+    if(index >= dir_ino->num_entries)
+      return 1;
+    fat_entry_t *e = &dir_ino->entries[index];
+    de->ino = fat_entry_inode(fs, dir, e);
+    src = e->name;
+  }
+  strncpy(name, src, name_size - 1);
+  name[name_size - 1] = '\0';
+  de->name = name;
+  return 0;
+}
+
+void fat_inode_stat(fat_inode_t *inode, fstat_t *st)
+{
+  st->size = inode->size;
+  st->mode = (inode->type == FAT_DIR_DIRECTORY)?S_DIR:0;
+  st->mode |= 0777;
+  st->atime = inode->atime;
+  st->ctime = inode->ctime;
+  st->mtime = inode->mtime;
+}
+
+unsigned int fat_readdirplus(struct fs_st *fs, INODE dir, unsigned int num, direntplus_t *entries, unsigned int count, fs_arena_t *arena)
+{
+  // Like readdir, but for count entries at once and with their stats.
+  // Inodes are made from the cached directory entries, so nothing more
+  // is read from disk.
+  if(!fs)
+    return 0;
+  if(!dir)
+    return 0;
+  if(!entries)
+    return 0;
+
+  fat_inode_t *dir_ino = fat_get_inode(fs, dir);
+  if(!dir_ino || dir_ino->type != FAT_DIR_DIRECTORY)
+    return 0;
+  if(!fat_get_entries(fs, dir))
+    return 0;
+
+  unsigned int n = 0;
+  for(; n < count; n++, num++)
+  {
+    direntplus_t *de = &entries[n];
+    if(num < 2) // . and ..
     {
-      ret->name = strdup(longname);
-      free(longname);
-    } else {
-      // Parse 8.3 name
-      ret->name = calloc(8, 1);
-      char *c;
-      if( (c = strchr((char *)de->name, ' ')))
-        c[0] = '\0';
-      c = stpncpy(ret->name, (char *)de->name, 8);
-      if(de->attrib != FAT_DIR_DIRECTORY)
-      {
-        c[0] = '.';
-        c++;
-      }
-        strncpy(c, (char *)&de->name[8],3);
-        if((c = strchr(ret->name, ' ')))
-          c[0] = '\0';
+      de->ino = num?dir_ino->parent:dir;
+      de->name = fs_arena_strndup(arena, num?"..":".", 2);
+      fat_inode_t *inode = fat_get_inode(fs, de->ino);
+      if(inode)
+        fat_inode_stat(inode, &de->st);
+      else
+        memset(&de->st, 0, sizeof(fstat_t));
+      continue;
     }
+    // Directories other than the root have . and .. on disk too
+    uint32_t index = (dir == 1)?num - 2:num;
+    if(index >= dir_ino->num_entries)
+      break;
+    fat_entry_t *e = &dir_ino->entries[index];
+    de->ino = fat_entry_inode(fs, dir, e);
+    de->name = fs_arena_strndup(arena, e->name, strlen(e->name));
+    fat_inode_stat(fat_get_inode(fs, de->ino), &de->st);
+  }
+  return n;
+}
 
-    // Build inode
-    fat_inode_t *inode = calloc(1, sizeof(fat_inode_t));
-    inode->parent = dir;
-    inode->type = de->attrib;
-    inode->cluster = (de->cluster_high << 16) + de->cluster_low;
-    inode->size = de->size;
-    // Parse times
-    struct tm *atime = calloc(1, sizeof(struct tm));
-    atime->tm_mday = (de->adate & 0x1F);
-    atime->tm_mon = ((de->adate >> 5) & 0xF);
-    atime->tm_year = ((de->adate >> 9) & 0x7F);
-
-    /* struct tm atime = */ 
-    /* { */
-    /*   0, 0, 0, //sec, min, hour */
-    /*   (de->adate & 0x1F), // day */
-    /*   ((de->adate >> 5) & 0xF), // month */
-    /*   ((de->adate >> 9) & 0x7F), // year */
-    /*   0,0,0,0,0 */
-    /* }; */
-
-    struct tm *ctime = calloc(1, sizeof(struct tm));
-    ctime->tm_sec = (de->ctime & 0x1F);
-    ctime->tm_min = ((de->ctime >> 5) & 0x3F);
-    ctime->tm_hour = ((de->ctime >> 11) & 0x1F);
-    ctime->tm_mday = (de->cdate & 0x1F);
-    ctime->tm_mon = ((de->cdate >> 5) & 0xF);
-    ctime->tm_year = ((de->cdate >> 9) & 0x7F);
-
-    /* struct tm ctime = */ 
-    /* { */
-    /*   (de->ctime & 0x1F), // sec */
-    /*   ((de->ctime >> 5) & 0x3F), // min */
-    /*   ((de->ctime >> 11) & 0x1F), // hour */
-    /*   (de->cdate & 0x1F), // day */
-    /*   ((de->cdate >> 5) & 0xF), // month */
-    /*   ((de->cdate >> 9) & 0x7F), // year */
-    /*   0,0,0,0,0 */
-    /* }; */
-
-    struct tm *mtime = calloc(1, sizeof(struct tm));
-    mtime->tm_sec = (de->mtime & 0x1F);
-    mtime->tm_min = ((de->mtime >> 5) & 0x3F);
-    mtime->tm_hour = ((de->mtime >> 11) & 0x1F);
-    mtime->tm_mday = (de->mdate & 0x1F);
-    mtime->tm_mon = ((de->mdate >> 5) & 0xF);
-    mtime->tm_year = ((de->mdate >> 9) & 0x7F);
-
-    /* struct tm mtime = */ 
-    /* { */
-    /*   (de->mtime & 0x1F), // sec */
-    /*   ((de->mtime >> 5) & 0x3F), // min */
-    /*   ((de->mtime >> 11) & 0x1F), // hour */
-    /*   (de->mdate & 0x1F), // day */
-    /*   ((de->mdate >> 5) & 0xF), // month */
-    /*   ((de->mdate >> 9) & 0x7F), // year */
-    /*   0,0,0,0,0 */
-    /* }; */
-    inode->atime = mktime(atime);
-    inode->ctime = mktime(ctime);
-    inode->mtime = mktime(mtime);
-    free(atime);
-    free(ctime);
-    free(mtime);
-
-    // Insert new inode into list
-    fat_data(fs)->last->next = inode;
-    fat_data(fs)->last = inode;
-    fat_data(fs)->next++;
+int fat_open(struct fs_st *fs, fs_file_t *file)
+{
+  // The inode and its cluster extents already stay cached in the inode
+  // table, so reads and writes through the file just use fat_read() and
+  // fat_write()
+  if(!fs)
+    return 1;
+  if(!file)
+    return 1;
+  if(!fat_get_inode(fs, file->ino))
+    return 1;
+  return 0;
+}
 
-    free(buffer);
-    return ret;
+int fat_map(struct fs_st *fs, INODE ino, fs_extent_t **extents, unsigned int *count)
+{
+  // Cluster runs of a file as byte ranges of the partition. The FAT12/16
+  // root directory is the one run of sectors before the data area.
+  if(!fs)
+    return 1;
+  if(!extents)
+    return 1;
+  if(!count)
+    return 1;
+
+  fat_inode_t *inode = fat_get_inode(fs, ino);
+  if(!inode)
+    return 1;
+
+  uint64_t sector = BLOCK_SIZE;
+  if(ino == fat_driver.root && fat_bits(fs) != 32)
+  {
+    fs_extent_t *map = calloc(1, sizeof(fs_extent_t));
+    map->logical = 0;
+    map->physical = (uint64_t)fat_root_start(fs)*sector;
+    map->length = (uint64_t)fat_root_sectors(fs)*sector;
+    *extents = map;
+    *count = 1;
+    return 0;
+  }
 
+  fat_extent_t *runs = fat_get_extents(fs, inode);
+  uint64_t cluster = fat_geo(fs)->cluster_sectors*sector;
+  fs_extent_t *map = calloc(inode->num_extents ? inode->num_extents : 1, sizeof(fs_extent_t));
+  uint32_t i;
+  for(i = 0; i < inode->num_extents; i++)
+  {
+    map[i].logical = runs[i].first*cluster;
+    map[i].physical = (fat_data_start(fs) + (uint64_t)(runs[i].start-2)*fat_geo(fs)->cluster_sectors)*sector;
+    map[i].length = runs[i].length*cluster;
   }
+
+  *extents = map;
+  *count = inode->num_extents;
+  return 0;
 }
 
 int fat_link(struct fs_st *fs, INODE ino, INODE dir, const char *name)
@@ -664,86 +1983,147 @@ int fat_link(struct fs_st *fs, INODE ino, INODE dir, const char *name)
 
   fat_inode_t *dino = fat_get_inode(fs, dir);
   fat_inode_t *iino = fat_get_inode(fs, ino);
-  iino->parent = dir;
-  uint32_t size = fat_clustercount(fs, dir)*fat_clustersize(fs);
-  void *buffer = calloc(1, size + fat_clustersize(fs));
-  fat_read(fs, dir, buffer, size, 0);
+  if(!dino || !iino)
+    return 1;
+  if(!fat_get_entries(fs, dir))
+    return 1;
 
-  uint32_t entries = strlen(name)/13 + 1; // Including longname
-  uint32_t found = 0;
-  fat_dir_t *firstfree = 0;
-  fat_dir_t *de = buffer;
-  int counter = 0;
-  while(de->name[0] != 0)
+  // . and .. shouldn't have longnames
+  int dot = !strcmp(name, ".          ") || !strcmp(name, "..         ");
+  uint32_t count = dot?1:(strlen(name) + 12)/13 + 1; // Including longname
+
+  // Use the first hole that is big enough, or add to the end
+  uint32_t slot = FAT_NO_ENTRY;
+  uint32_t r;
+  for(r = 0; r < dino->num_free_slots; r++)
   {
-    if(de->name[0] == 0xE5)
+    if(dino->free_slots[r].length >= count)
     {
-      if(!found)
-        firstfree = de;
-      found++;
-      if(found == entries)
-      {
-        // Found a big enough hole
-        de = firstfree;
-        break;
-      }
-    } else {
-      found = 0;
+      slot = dino->free_slots[r].start;
+      break;
+    }
+  }
+  uint32_t num_slots = fat_dir_size(fs, dir)/sizeof(fat_dir_t);
+  int append = (slot == FAT_NO_ENTRY);
+  if(append)
+  {
+    slot = dino->end_slot;
+    // Increase size for directory if needed
+    while(slot + count > num_slots)
+    {
+      uint32_t current = fat_find_free(fs);
+      if((dir == 1 && fat_bits(fs) != 32) || !current)
+        return 1; // The FAT12/16 root directory can't grow
+      void *zero = calloc(1, fat_clustersize(fs));
+      fat_writeclusters(fs, zero, current, 1);
+      free(zero);
+      uint32_t last = dino->cluster;
+      while(fat_read_fat(fs, last) < FAT_END)
+        last = fat_read_fat(fs, last);
+      fat_write_fat(fs, last, current);
+      fat_write_fat(fs, current, FAT_EOC);
+      fat_drop_extents(fs, dir);
+      num_slots += fat_clustersize(fs)/sizeof(fat_dir_t);
     }
-    de++;
-    counter++;
   }
 
-  firstfree = de;
-  // de is the first free entry.
-  if(strcmp(name, ".          ") && strcmp(name, "..         "))
+  // Build the entries, and a new end of directory marker if there is
+  // room for one
+  uint32_t length = count + (append && slot + count < num_slots);
+  fat_dir_t *buffer = calloc(length, sizeof(fat_dir_t));
+  fat_dir_t *de = buffer;
+  if(!dot)
   {
+    if(!dino->name_buckets)
+      fat_build_names(dino);
+    char shortname[11];
+    fat_unique_shortname(dino, name, shortname);
     de = fat_write_longname(de, name);
-    char *shortname = fat_make_shortname(name);
-    strncpy((char *)de->name, shortname, 11);
-    free(shortname);
+    memcpy(de->name, shortname, 11);
+    // The long name entries carry the checksum of the 8.3 name
+    fat_longname_t *ln = (fat_longname_t *)buffer;
+    uint32_t k;
+    for(k = 0; k + 1 < count; k++)
+      ln[k].checksum = fat_checksum(shortname);
   } else {
-    // . and .. shouldn't have longnames
-    strcpy((char *)de->name, name);
+    memcpy(de->name, name, 11);
   }
   de->attrib = iino->type;
   de->csec = 0;
 
   // Wibbly-wobbly timey-wimey stuff
-  time_t ctm = iino->ctime;
-  struct tm *ctime = gmtime(&ctm);
-  de->ctime = ((ctime->tm_hour & 0x1F) << 11) | ((ctime->tm_min &0x3F) << 5) | ((ctime->tm_sec & 0x1F));
-  de->cdate = ((ctime->tm_year & 0x7F) << 9) | ((ctime->tm_mon & 0xF) << 5) | ((ctime->tm_mday & 0x1F));
-  time_t atm = iino->atime;
-  struct tm *atime = gmtime(&atm);
-  de->adate = ((atime->tm_year & 0x7F) << 9) | ((atime->tm_mon & 0xF) << 5) | ((atime->tm_mday & 0x1F));
-  time_t mtm = iino->mtime;
-  struct tm *mtime = gmtime(&mtm);
-  de->mtime = ((mtime->tm_hour & 0x1F) << 11) | ((mtime->tm_min &0x3F) << 5) | ((mtime->tm_sec & 0x1F));
-  de->mdate = ((mtime->tm_year & 0x7F) << 9) | ((mtime->tm_mon & 0xF) << 5) | ((mtime->tm_mday & 0x1F));
-
-  de->cluster_high = iino->cluster >> 16;
-  de->cluster_low = iino->cluster & 0xFF;
+  de->ctime = fat_encode_time(iino->ctime);
+  de->cdate = fat_encode_date(iino->ctime);
+  de->adate = fat_encode_date(iino->atime);
+  de->mtime = fat_encode_time(iino->mtime);
+  de->mdate = fat_encode_date(iino->mtime);
+
+  // .. entries pointing to the root directory use cluster 0, also on
+  // FAT32
+  uint32_t cluster = (ino == 1)?0:iino->cluster;
+  de->cluster_high = cluster >> 16;
+  de->cluster_low = cluster & 0xFFFF;
   de->size = iino->size;
 
-  // Increase size for directory if needed
-  de++;
-  if((size_t)de > (size_t)buffer + size)
+  if(fat_write_sectors(fs, dir, buffer, length*sizeof(fat_dir_t), \
+        (uint64_t)slot*sizeof(fat_dir_t)) != length*sizeof(fat_dir_t))
+  {
+    free(buffer);
+    fat_drop_entries(fs, dir);
+    return 1;
+  }
+
+  // Update the cached directory
+  if(append)
   {
-    uint32_t last = 0, current = dino->cluster;
-    while(current != FAT_END)
+    dino->end_slot = slot + count;
+  } else {
+    dino->free_slots[r].start += count;
+    dino->free_slots[r].length -= count;
+    if(!dino->free_slots[r].length)
     {
-      last = current;
-      current = fat_read_fat(fs, current);
+      dino->num_free_slots--;
+      memmove(&dino->free_slots[r], &dino->free_slots[r + 1], \
+          (dino->num_free_slots - r)*sizeof(fat_slots_t));
     }
-    current = fat_find_free(fs);
-    fat_write_fat(fs, last, current);
-    fat_write_fat(fs, current, FAT_END);
-    size += fat_clustersize(fs);
   }
-  fat_write(fs, dir, buffer, size, 0);
-
+  uint32_t index = slot + count - 1;
+  uint32_t pos = dino->num_entries;
+  while(pos && dino->entries[pos - 1].index > index)
+    pos--;
+  if(dino->num_entries == dino->max_entries)
+  {
+    dino->max_entries *= 2;
+    dino->entries = realloc(dino->entries, dino->max_entries*sizeof(fat_entry_t));
+  }
+  fat_entry_t *entries = dino->entries;
+  memmove(&entries[pos + 1], &entries[pos], (dino->num_entries - pos)*sizeof(fat_entry_t));
+  dino->num_entries++;
+  fat_entry_t *e = &entries[pos];
+  fat_format_shortname(de->name, e->shortname);
+  e->name = strdup(dot?e->shortname:name);
+  e->attrib = de->attrib;
+  e->cluster = cluster;
+  e->size = de->size;
+  e->atime = fat_decode_time(de->adate, 0);
+  e->ctime = fat_decode_time(de->cdate, de->ctime);
+  e->mtime = fat_decode_time(de->mdate, de->mtime);
+  e->first = slot;
+  e->index = index;
   free(buffer);
+  if(dino->name_buckets)
+  {
+    if(dino->num_entries > dino->num_name_buckets)
+      fat_build_names(dino);
+    else
+      fat_hash_name(dino, e);
+  }
+
+  if(!dot)
+  {
+    iino->parent = dir;
+    fat_hash_entry(fs, ino, dino->cluster, index);
+  }
 
   return 0;
 }
@@ -763,70 +2143,62 @@ int fat_unlink(struct fs_st *fs, INODE dir, unsigned int num)
   if(dir_ino->type != FAT_DIR_DIRECTORY)
     return 1;
 
-  dirent_t *dirent = fat_readdir(fs, dir, num);
-  INODE item = dirent->ino;
-  free(dirent->name);
-  free(dirent);
-
-  uint32_t size = fat_clustercount(fs, dir)*fat_clustersize(fs);
-  void *buffer = calloc(1, size);
-  size_t max = (size_t)buffer + size;
-  fat_read(fs, dir, buffer, size, 0);
-
-  if(dir != 1)
-    num +=2;
-
-  // Find the right entry
-  fat_dir_t *de = buffer;
-  while((num > 2) && ((size_t)de < max))
+  // Find the entry the same way readdir does
+  fat_entry_t *entries = fat_get_entries(fs, dir);
+  if(!entries)
+    return 1;
+  if(dir == 1)
+    num -= 2;
+  if(num >= dir_ino->num_entries)
+    return 1;
+  fat_entry_t *e = &entries[num];
+  INODE item = fat_entry_inode(fs, dir, e);
+
+  // Mark the entry and its longname entries as deleted, only the sectors
+  // they are in are written
+  uint32_t count = e->index - e->first + 1;
+  uint64_t offset = (uint64_t)e->first*sizeof(fat_dir_t);
+  fat_dir_t *buffer = calloc(count, sizeof(fat_dir_t));
+  if(fat_read(fs, dir, buffer, count*sizeof(fat_dir_t), offset) != count*sizeof(fat_dir_t))
   {
-    if(de->name[0] == 0)
-    {
-      free(buffer);
-      return 1;
-    }
-    if(de->attrib == FAT_DIR_LONGNAME)
-    {
-      de++;
-    } else {
-      de++;
-      num--;
-    }
+    free(buffer);
+    return 1;
   }
-  if(de->name[0] == 0)
+  uint32_t i;
+  for(i = 0; i < count; i++)
+    buffer[i].name[0] = 0xE5;
+  if(fat_write_sectors(fs, dir, buffer, count*sizeof(fat_dir_t), offset) != count*sizeof(fat_dir_t))
   {
     free(buffer);
+    fat_drop_entries(fs, dir);
     return 1;
   }
-
-
-  void *start = de;
-
-  // Find start of next entry
-  while(de->attrib == FAT_DIR_LONGNAME) de++;
-  de++;
-  void *next = de;
-  void *buffer2 = calloc(1, size);
-  // Copy data, skipping the entries we want to remove.
-  memcpy(buffer2, buffer, (size_t)start - (size_t)buffer);
-  memcpy((void *)((size_t)buffer2 + ((size_t)start - (size_t)buffer)), next, (size_t)max - (size_t)next);
-  // Write it back
-  fat_write(fs, dir, buffer2, size, 0);
-
   free(buffer);
-  free(buffer2);
+
+  // Update the cached directory. Nothing else moves, so the entries of
+  // other inodes stay where they are.
+  fat_unhash_entry(fs, item);
+  if(dir_ino->name_buckets)
+    fat_unhash_name(dir_ino, e);
+  uint32_t first = e->first;
+  uint32_t last = e->index;
+  free(e->name);
+  dir_ino->num_entries--;
+  memmove(e, e + 1, (dir_ino->num_entries - num)*sizeof(fat_entry_t));
+  fat_free_slots(dir_ino, first, last + 1);
 
   // Mark the files clusters as free in the FAT
-  uint32_t *clusters = fat_get_clusters(fs, item);
-  int i = 0;
-  while(clusters[i])
+  fat_inode_t *item_ino = fat_get_inode(fs, item);
+  if(item_ino)
   {
-    fat_write_fat(fs, clusters[i], 0);
-    i++;
+    fat_extent_t *extents = fat_get_extents(fs, item_ino);
+    uint32_t x;
+    for(x = 0; x < item_ino->num_extents; x++)
+      for(i = 0; i < extents[x].length; i++)
+        fat_write_fat(fs, extents[x].start + i, 0);
+    fat_drop_extents(fs, item);
   }
 
-  free(clusters);
-
   return 0;
 }
 
@@ -841,17 +2213,23 @@ fstat_t *fat_fstat(struct fs_st *fs, INODE ino)
     return 0;
 
   fstat_t *ret = calloc(1, sizeof(fstat_t));
-  ret->size = inode->size;
-  if(inode->type == FAT_DIR_DIRECTORY)
-    ret->mode = S_DIR;
-  ret->mode |= 0777;
-  ret->atime = inode->atime;
-  ret->ctime = inode->ctime;
-  ret->mtime = inode->mtime;
-
+  fat_inode_stat(inode, ret);
   return ret;
 }
 
+int fat_fstat_r(struct fs_st *fs, INODE ino, fstat_t *st)
+{
+  if(!fs)
+    return 1;
+  if(!ino)
+    return 1;
+  fat_inode_t *inode = fat_get_inode(fs, ino);
+  if(!inode)
+    return 1;
+  fat_inode_stat(inode, st);
+  return 0;
+}
+
 int fat_mkdir(struct fs_st *fs, INODE parent, const char *name)
 {
   if(!fs)
@@ -868,7 +2246,7 @@ int fat_mkdir(struct fs_st *fs, INODE parent, const char *name)
   st.ctime = time(0);
   st.mtime = time(0);
 
-  INODE child = fat_touch(fs, &st);
+  INODE child = fat_touch(fs, &st, parent);
   if(fat_link(fs, child, parent, name))
     return 1;
 
@@ -902,106 +2280,253 @@ int fat_rmdir(struct fs_st *fs, INODE dir, unsigned int num)
   return 0;
 }
 
-void *fat_hook_load(struct fs_st *fs)
+void fat_setup(struct fs_st *fs)
+{
+  // In-memory state shared by load and create
+  fat_data_t *data = fat_data(fs);
+
+  // Generate root inode
+  fat_inode_t *root = calloc(1, sizeof(fat_inode_t));
+  root->parent = 1;
+  root->type = FAT_DIR_DIRECTORY;
+  root->cluster = (fat_bits(fs) == 32)?fat_bpb(fs)->fat32.root_cluster:0;
+  root->size = 0;
+  data->next = 1;
+  fat_add_inode(fs, root);
+}
+
+void *fat_hook_load(struct fs_st *fs, fs_options_t *opt)
 {
   fat_data_t *data = fs->data = calloc(1, sizeof(fat_data_t));
 
   // Read BPB
   data->bpb = calloc(1, BLOCK_SIZE);
   partition_readblocks(fs->p, data->bpb, 0, 1);
+  fat_compute_geometry(fs);
+
+  // Read FAT, or only the parts of it that are used if it is larger than
+  // the cache asked for. FAT12 entries can span pages so it is always
+  // read whole, it is small anyway.
+  if(opt && opt->cache_size && opt->cache_size < fat_sectors_per_fat(fs) \
+      && fat_bits(fs) != 12)
+  {
+    fat_setup_pages(fs, opt->cache_size);
+  } else {
+    data->fat = calloc(fat_sectors_per_fat(fs), BLOCK_SIZE);
+    partition_readblocks(fs->p, data->fat, fat_fat_start(fs), fat_sectors_per_fat(fs));
+    fat_load_table(fs);
+  }
 
-  // Read FAT
-  data->fat = calloc(fat_bpb(fs)->sectors_per_fat, BLOCK_SIZE);
-  partition_readblocks(fs->p, data->fat, data->bpb->reserved_sectors, fat_bpb(fs)->sectors_per_fat);
+  fat_setup(fs);
 
-  // Generate root inode
-  data->inodes = calloc(1, sizeof(fat_inode_t));
-  data->inodes->parent = 1;
-  data->inodes->type = FAT_DIR_DIRECTORY;
-  data->inodes->cluster = 0;
-  data->inodes->size = 0;
-  data->last = data->inodes;
-  data->next = 2;
+  // FAT32 keeps a hint of where to look for free clusters
+  if(fat_bits(fs) == 32 && fat_bpb(fs)->fat32.fsinfo_cluster)
+  {
+    fat_fsinfo_t *info = calloc(1, BLOCK_SIZE);
+    partition_readblocks(fs->p, info, fat_bpb(fs)->fat32.fsinfo_cluster, 1);
+    if(info->signature1 == FAT_FSINFO_SIGNATURE1 && info->signature2 == FAT_FSINFO_SIGNATURE2 \
+        && info->next_free >= 2 && info->next_free < fat_num_clusters(fs) + 2)
+      data->next_free = info->next_free;
+    free(info);
+  }
 
   return 0;
 }
 
-void *fat_hook_create(struct fs_st *fs)
+void *fat_hook_create(struct fs_st *fs, fs_options_t *opt)
 {
   fat_data_t *data = fs->data = calloc(1, sizeof(fat_data_t));
 
   fat_bpb_t *bpb = data->bpb = calloc(1, sizeof(fat_bpb_t));
 
+  if(fs->p->length > 0xFFFFFFFF)
+  {
+    printf("Warning: Partition is too large for FAT!\n");
+    free(data->bpb);
+    free(data);
+    fs->data = 0;
+    return 0;
+  }
   uint32_t num_sectors = fs->p->length;
-  uint32_t fs_size = num_sectors * BLOCK_SIZE;
+  uint64_t fs_size = (uint64_t)num_sectors * BLOCK_SIZE;
 
-  // What kind of FAT do we need?
+  // Block size option selects the cluster size
+  int requested = 0;
+  if(opt->block_size >= BLOCK_SIZE && opt->block_size <= 128*BLOCK_SIZE \
+      && !(opt->block_size & (opt->block_size - 1)))
+    requested = opt->block_size / BLOCK_SIZE;
+
+  // What kind of FAT do we need? With a given cluster size the type
+  // follows from the number of clusters.
   int fat_bits = 12;
-  if(fs_size >= 0x80000000) // 2048 Mb
+  if(requested)
+  {
+    uint32_t clusters = num_sectors/requested;
+    if(clusters >= 65525)
+      fat_bits = 32;
+    else if(clusters >= 4085)
+      fat_bits = 16;
+  }
+  else if(fs_size >= 0x80000000) // 2048 Mb
     fat_bits = 32;
   else if(fs_size >= 0x1000000) // 16 Mb
     fat_bits = 16;
 
-  // All but FAT12 are unsupported
-  if(fat_bits != 12)
+  uint32_t min_clusters, max_clusters, root_sectors, sectors_per_fat = 0, num_clusters;
+  int cluster_size;
+  while(1)
   {
-    printf("Warning: Partition size requires fat 16 or 32, which are not implemented!\n");
-    return 0;
-  }
+    // Start from a cluster size that suits the FAT type and double it
+    // until the number of clusters is within the limits of the type.
+    // The type is decided by the number of clusters when loading.
+    min_clusters = (fat_bits == 12)?0:(fat_bits == 16)?4085:65525;
+    max_clusters = (fat_bits == 12)?4085:(fat_bits == 16)?65525:0x0FFFFFF5;
+    cluster_size = (fat_bits == 16)?4:8;
+    if(fat_bits == 32)
+    {
+      if(fs_size >= 0x800000000ULL) // 32 Gb
+        cluster_size = 64;
+      else if(fs_size >= 0x400000000ULL) // 16 Gb
+        cluster_size = 32;
+      else if(fs_size >= 0x200000000ULL) // 8 Gb
+        cluster_size = 16;
+    }
+    if(requested)
+      cluster_size = requested;
 
-  printf("Formating using FAT%d\n", fat_bits);
+    bpb->reserved_sectors = (fat_bits == 32)?32:4;
+    if(fat_bits != 32)
+    {
+      if(fs_size > 0x400000) // 4 mb (2.88 mb floppy disk - I think...)
+        bpb->root_count = 512;
+      else
+        bpb->root_count = 240;
+    } else {
+      bpb->root_count = 0;
+    }
+    bpb->fat_count = 2;
+
+    root_sectors = (bpb->root_count*32 + BLOCK_SIZE - 1)/BLOCK_SIZE;
+    if(num_sectors <= bpb->reserved_sectors + root_sectors)
+    {
+      num_clusters = 0;
+      break;
+    }
+    while(1)
+    {
+      // Size the FAT for all sectors after the reserved ones and the root
+      // directory. That is slightly more than needed, since the FATs
+      // themselves don't hold clusters.
+      uint32_t data_sectors = num_sectors - bpb->reserved_sectors - root_sectors;
+      uint64_t entries = data_sectors/cluster_size + 2;
+      sectors_per_fat = (entries*fat_bits/8 + BLOCK_SIZE - 1)/BLOCK_SIZE;
+      if((uint64_t)bpb->fat_count*sectors_per_fat >= data_sectors)
+        num_clusters = 0;
+      else
+        num_clusters = (data_sectors - bpb->fat_count*sectors_per_fat)/cluster_size;
+      if(num_clusters < max_clusters || cluster_size >= 128 || requested)
+        break;
+      cluster_size *= 2;
+    }
 
-  int cluster_size = 8;
-  while(fs_size >= 0x1000000) // 16 Mb
+    // The FAT itself eats into the data area, so the clusters left may
+    // be too few for this type. Use the next smaller one instead.
+    if(num_clusters >= min_clusters || fat_bits == 12)
+      break;
+    fat_bits = (fat_bits == 32)?16:12;
+  }
+  if(num_clusters < min_clusters || num_clusters >= max_clusters)
   {
-    cluster_size *= 2;
-    fs_size /= 2;
+    printf("Warning: Can't fit FAT%d on the partition with this cluster size!\n", fat_bits);
+    free(data->bpb);
+    free(data);
+    fs->data = 0;
+    return 0;
   }
 
+  printf("Formating using FAT%d\n", fat_bits);
+
   // Set up boot parameter block
   bpb->jmp[0] = 0xEB;
-  bpb->jmp[1] = 0x3C;
+  bpb->jmp[1] = (fat_bits == 32)?0x58:0x3C;
   bpb->jmp[2] = 0x90;
   strncpy((char *)bpb->identifier, "mkdosfs ",8);
   bpb->bytes_per_sector = 512;
-  bpb->sectors_per_cluster = cluster_size;
-  bpb->reserved_sectors = (fat_bits == 32)?32:4;
-  bpb->fat_count = 2;
-  if(fat_bits != 32)
-  {
-    if(fs_size > 0x400000) // 4 mb (2.88 mb floppy disk - I think...)
-      bpb->root_count = 512;
-    else
-      bpb->root_count = 240;
-  } else {
-    bpb->root_count = 0;
-  }
   bpb->total_sectors_small = (num_sectors > 65535)?0:num_sectors;
   bpb->total_sectors_large = (num_sectors > 65535)?num_sectors:0;
   bpb->media_descriptor = (fs_size > 0x400000)?0xF8:0xF0;
+  bpb->sectors_per_track = 32;
+  bpb->num_heads = 64;
+  bpb->hidden_sectors = 0;
+
+  bpb->sectors_per_cluster = cluster_size;
+
+  uint8_t *label = bpb->fat16.volume_label;
   if(fat_bits != 32)
   {
-    uint32_t fat_size = num_sectors/cluster_size - bpb->reserved_sectors;
-    uint32_t entries_per_sector = bpb->bytes_per_sector*8/fat_bits;
-    bpb->sectors_per_fat = fat_size/entries_per_sector;
-    if(fat_size%entries_per_sector)
-      bpb->sectors_per_fat++;
+    bpb->sectors_per_fat = sectors_per_fat;
+    bpb->fat16.drive = 0x80;
+    bpb->fat16.signature = 0x29;
+    bpb->fat16.volume_id = time(0);
+    strncpy((char *)bpb->fat16.system_id, (fat_bits == 12)?"FAT12   ":"FAT16   ", 8);
+    bpb->fat16.boot_signature[0] = 0x55;
+    bpb->fat16.boot_signature[1] = 0xAA;
   } else {
     bpb->sectors_per_fat = 0;
+    bpb->fat32.sectors_per_fat = sectors_per_fat;
+    bpb->fat32.root_cluster = 2;
+    bpb->fat32.fsinfo_cluster = 1;
+    bpb->fat32.boot_backup_cluster = 6;
+    bpb->fat32.drive = 0x80;
+    bpb->fat32.signature = 0x29;
+    bpb->fat32.volume_id = time(0);
+    strncpy((char *)bpb->fat32.system_id, "FAT32   ", 8);
+    bpb->fat32.boot_signature[0] = 0x55;
+    bpb->fat32.boot_signature[1] = 0xAA;
+    label = bpb->fat32.volume_label;
   }
-  bpb->sectors_per_track = 32;
-  bpb->num_heads = 64;
-  bpb->hidden_sectors = 0;
+  memcpy(label, "NO NAME    ", 11);
 
   // Set up FAT tables
-  data->fat = calloc(fat_bpb(fs)->sectors_per_fat, BLOCK_SIZE);
-  fat_write_fat(fs, 0, 0xF00 | bpb->media_descriptor);
-  fat_write_fat(fs, 1, 0xFFF);
+  fat_compute_geometry(fs);
+  data->fat = calloc(sectors_per_fat, BLOCK_SIZE);
+  fat_load_table(fs);
+  // Everything has to be written the first time
+  memset(data->dirty, 0xFF, (sectors_per_fat/32 + 1)*sizeof(uint32_t));
+  fat_write_fat(fs, 0, 0x0FFFFF00 | bpb->media_descriptor);
+  fat_write_fat(fs, 1, FAT_EOC);
+
+  // Clear the root directory
+  void *zero = calloc(1, (fat_bits == 32)?fat_clustersize(fs):root_sectors*BLOCK_SIZE);
+  if(fat_bits == 32)
+  {
+    fat_write_fat(fs, bpb->fat32.root_cluster, FAT_EOC);
+    fat_writeclusters(fs, zero, bpb->fat32.root_cluster, 1);
+  } else {
+    partition_writeblocks(fs->p, zero, fat_root_start(fs), root_sectors);
+  }
+  free(zero);
+
+  fat_setup(fs);
 
   // Write boot parameter block to disk
   partition_writeblocks(fs->p, data->bpb, 0, 1);
+  if(fat_bits == 32)
+  {
+    // Backup boot sector, and the FSInfo sector written by hook_close
+    partition_writeblocks(fs->p, data->bpb, bpb->fat32.boot_backup_cluster, 1);
+    fat_fsinfo_t *info = calloc(1, BLOCK_SIZE);
+    info->signature1 = FAT_FSINFO_SIGNATURE1;
+    info->signature2 = FAT_FSINFO_SIGNATURE2;
+    info->signature3 = FAT_FSINFO_SIGNATURE3;
+    info->free_count = 0xFFFFFFFF;
+    info->next_free = 0xFFFFFFFF;
+    partition_writeblocks(fs->p, info, bpb->fat32.fsinfo_cluster, 1);
+    partition_writeblocks(fs->p, info, bpb->fat32.boot_backup_cluster + 1, 1);
+    free(info);
+  }
 
-  return 0;
+  return data;
 }
 
 void fat_hook_close(struct fs_st *fs)
@@ -1009,27 +2534,45 @@ void fat_hook_close(struct fs_st *fs)
   if(!fs)
     return;
 
-  // Write FATs to disk
+  // Write changed parts of the FATs to disk
   fat_data_t *data = fat_data(fs);
-  int i = 0;
-  uint32_t offset = data->bpb->reserved_sectors;
-  while(i < data->bpb->fat_count)
+  fat_sync_fat(fs);
+
+  // Update the free cluster hints. Without the free map the count is not
+  // known, so if the FAT changed it is marked as unknown.
+  if((data->free_map || data->fat_changed) && fat_bits(fs) == 32 && fat_bpb(fs)->fat32.fsinfo_cluster)
   {
-    partition_writeblocks(fs->p, data->fat, offset,  data->bpb->sectors_per_fat);
-    offset += data->bpb->sectors_per_fat;
-    i++;
+    fat_fsinfo_t *info = calloc(1, BLOCK_SIZE);
+    partition_readblocks(fs->p, info, fat_bpb(fs)->fat32.fsinfo_cluster, 1);
+    if(info->signature1 == FAT_FSINFO_SIGNATURE1 && info->signature2 == FAT_FSINFO_SIGNATURE2)
+    {
+      info->free_count = data->free_map?data->num_free:0xFFFFFFFF;
+      info->next_free = data->next_free;
+      partition_writeblocks(fs->p, info, fat_bpb(fs)->fat32.fsinfo_cluster, 1);
+    }
+    free(info);
   }
 
   // Free buffered inodes
-  while(data->inodes)
+  INODE ino;
+  for(ino = 1; ino < data->next; ino++)
   {
-    data->last = data->inodes;
-    data->inodes = data->inodes->next;
-    free(data->last);
+    fat_drop_extents(fs, ino);
+    fat_drop_entries(fs, ino);
+    free(data->inodes[ino - 1]);
   }
+  free(data->inodes);
+  free(data->buckets);
+  free(data->free_map);
 
   free(data->bpb);
   free(data->fat);
+  free(data->table);
+  free(data->dirty);
+  uint32_t i;
+  for(i = 0; i < data->num_pages; i++)
+    free(data->pages[i].data);
+  free(data->pages);
   free(data);
   return;
 }
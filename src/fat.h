@@ -30,7 +30,7 @@ typedef struct fat_bpb_st
       uint8_t system_id[8];
       uint8_t unused[448];
       uint8_t boot_signature[2];
-    } fat16;
+    }__attribute__((packed)) fat16;
     struct
     {
       uint32_t sectors_per_fat;
@@ -48,7 +48,7 @@ typedef struct fat_bpb_st
       uint8_t system_id[8];
       uint8_t unused[420];
       uint8_t boot_signature[2];
-    } fat32;
+    }__attribute__((packed)) fat32;
   };
 }__attribute__((packed)) fat_bpb_t;
 
@@ -76,7 +76,26 @@ typedef struct fat_dir_st
 #define FAT_DIR_ARCHIVE 0x20
 #define FAT_DIR_LONGNAME 0x0F
 
-#define FAT_END 0xFF8
+// FAT entries are extended to 28 bits when read, so the same values
+// work for FAT12, FAT16 and FAT32
+#define FAT_END 0x0FFFFFF8 // Any value from here up ends a cluster chain
+#define FAT_EOC 0x0FFFFFFF
+#define FAT_BAD 0x0FFFFFF7
+
+typedef struct fat_fsinfo_st
+{
+  uint32_t signature1;
+  uint8_t reserved1[480];
+  uint32_t signature2;
+  uint32_t free_count;
+  uint32_t next_free;
+  uint8_t reserved2[12];
+  uint32_t signature3;
+}__attribute__((packed)) fat_fsinfo_t;
+
+#define FAT_FSINFO_SIGNATURE1 0x41615252
+#define FAT_FSINFO_SIGNATURE2 0x61417272
+#define FAT_FSINFO_SIGNATURE3 0xAA550000
 
 typedef struct fat_longname_st
 {
@@ -90,9 +109,36 @@ typedef struct fat_longname_st
   uint8_t name3[4];
 }__attribute__((packed)) fat_longname_t;
 
+typedef struct fat_entry_st
+{
+  char *name; // Long name if there is one, otherwise the 8.3 name
+  char shortname[13]; // 8.3 name with a dot
+  uint8_t attrib;
+  uint32_t cluster;
+  uint32_t size;
+  uint32_t atime;
+  uint32_t ctime;
+  uint32_t mtime;
+  uint32_t first; // Position of the first long name slot in the directory
+  uint32_t index; // Position of the short entry in the directory
+  uint32_t hash_next[2]; // Next in the long and short name hash chains
+} fat_entry_t;
+
+typedef struct fat_slots_st
+{
+  uint32_t start;
+  uint32_t length;
+} fat_slots_t;
+
+typedef struct fat_extent_st
+{
+  uint32_t first; // Index of the first cluster in the file
+  uint32_t start; // First cluster on disk
+  uint32_t length; // Number of consecutive clusters
+} fat_extent_t;
+
 typedef struct fat_inode_st
 {
-  struct fat_inode_st *next;
   INODE parent;
   uint8_t type;
   uint32_t cluster;
@@ -100,45 +146,121 @@ typedef struct fat_inode_st
   uint32_t atime;
   uint32_t ctime;
   uint32_t mtime;
+  // Location of the directory entry, used as a key to find the inode
+  // again. dir_index is FAT_NO_ENTRY until the inode is linked.
+  uint32_t dir_cluster;
+  uint32_t dir_index;
+  INODE hash_next;
+  // Cluster chain as runs of consecutive clusters, built when first
+  // needed and dropped when the chain changes
+  fat_extent_t *extents;
+  uint32_t num_extents;
+  uint32_t num_clusters;
+  // Parsed entries of a directory, built when first needed and dropped
+  // when the directory changes
+  fat_entry_t *entries;
+  uint32_t num_entries;
+  uint32_t max_entries;
+  // Runs of unused slots before end_slot, the slot after the last entry
+  fat_slots_t *free_slots;
+  uint32_t num_free_slots;
+  uint32_t end_slot;
+  // Entries by case folded long and short names, built on the first
+  // lookup. Chains hold index*2, plus one for short names.
+  uint32_t *name_buckets;
+  uint32_t num_name_buckets;
 } fat_inode_t;
 
+#define FAT_NO_ENTRY 0xFFFFFFFF
+
+typedef struct
+{
+  int bits; // Width of FAT entries: 12, 16 or 32
+  uint32_t fat_start; // First sector of the first FAT
+  uint32_t fat_sectors; // Sectors per FAT
+  uint32_t root_start; // First sector of the FAT12/16 root directory
+  uint32_t root_sectors;
+  uint32_t data_start; // First sector of cluster 2
+  uint32_t cluster_sectors;
+  uint32_t cluster_size; // In bytes
+  int cluster_shift; // log2 of cluster_size
+  uint32_t num_clusters;
+  uint32_t (*decode)(uint8_t *fat, uint32_t cluster);
+  void (*encode)(uint8_t *fat, uint32_t cluster, uint32_t set);
+} fat_geometry_t;
+
+typedef struct
+{
+  uint32_t page; // Page number, FAT_NO_ENTRY if unused
+  uint8_t *data;
+  int dirty;
+} fat_page_t;
+
+#define FAT_PAGE_SECTORS 8
+
 typedef struct
 {
   fat_bpb_t *bpb;
-  uint8_t *fat;
-  fat_inode_t *inodes;
-  fat_inode_t *last;
+  fat_geometry_t geo; // Computed from the BPB when loading
+  uint8_t *fat; // FAT as stored on disk, updated from table when written
+  uint32_t *table; // Decoded FAT entries
+  uint32_t num_entries;
+  uint32_t *dirty; // One bit per FAT sector changed in table
+  // Instead of fat and table, FAT16/32 can be read on demand in pages of
+  // FAT_PAGE_SECTORS sectors. Page n is kept in pages[n % num_pages].
+  fat_page_t *pages;
+  uint32_t num_pages;
+  fat_inode_t **inodes; // Indexed by INODE - 1
+  unsigned int max_inodes;
   INODE next;
+  INODE *buckets; // Inodes by directory entry location
+  unsigned int num_buckets;
+  unsigned int num_hashed;
+  uint32_t *free_map; // One bit per cluster, set if the cluster is free
+  uint32_t num_free;
+  uint32_t next_free; // Where to start looking for free clusters
+  int fat_changed; // Set when an entry is written, FSInfo is stale then
 } fat_data_t;
 
 #define fat_data(fs) ((fat_data_t *)(fs)->data)
 #define fat_bpb(fs) ((fat_data((fs)))->bpb)
-#define fat_root_sectors(fs) (((fat_bpb(fs)->root_count * 32) + (fat_bpb(fs)->bytes_per_sector - 1)) \
-  / fat_bpb(fs)->bytes_per_sector)
-#define fat_first_data_sector(fs) (fat_bpb(fs)->reserved_sectors \
-  + (fat_bpb(fs)->fat_count * fat_bpb(fs)->sectors_per_fat))
-#define fat_fat_start(fs) (fat_bpb(fs)->reserved_sectors)
-#define fat_num_sectors(fs) ((fat_bpb(fs)->total_sectors_small + fat_bpb(fs)->total_sectors_large) \
-  - fat_bpb(fs)->reserved_sectors \
-  - (fat_bpb(fs)->fat_count * fat_bpb(fs)->sectors_per_fat) \
-  - fat_root_sectors(fs))
-#define fat_num_clusters(fs) (fat_num_sectors(fs) / fat_bpb(fs)->sectors_per_cluster)
-#define fat_clustersize(fs) (fat_bpb(fs)->bytes_per_sector*fat_bpb(fs)->sectors_per_cluster)
+#define fat_geo(fs) (&fat_data(fs)->geo)
+#define fat_bits(fs) (fat_geo(fs)->bits)
+#define fat_root_sectors(fs) (fat_geo(fs)->root_sectors)
+#define fat_sectors_per_fat(fs) (fat_geo(fs)->fat_sectors)
+#define fat_root_start(fs) (fat_geo(fs)->root_start)
+#define fat_data_start(fs) (fat_geo(fs)->data_start)
+#define fat_fat_start(fs) (fat_geo(fs)->fat_start)
+#define fat_num_clusters(fs) (fat_geo(fs)->num_clusters)
+#define fat_clustersize(fs) (fat_geo(fs)->cluster_size)
+#define fat_cluster_shift(fs) (fat_geo(fs)->cluster_shift)
 
 #define fat_type(fs, a, b, c) (if(fat_bits(fs)==12)(a);else if(fat_bits(fs)==16)(b); else(c);)
 
 extern fs_driver_t fat_driver;
 
-int fat_read(struct fs_st *fs, INODE ino, void *buffer, size_t length, size_t offset);
-int fat_write(struct fs_st *fs, INODE ino, void *buffer, size_t length, size_t offset);
-INODE fat_touch(struct fs_st *fs, fstat_t *st);
+size_t fat_read(struct fs_st *fs, INODE ino, void *buffer, size_t length, uint64_t offset);
+size_t fat_write(struct fs_st *fs, INODE ino, void *buffer, size_t length, uint64_t offset);
+INODE fat_touch(struct fs_st *fs, fstat_t *st, INODE dir);
 dirent_t *fat_readdir(struct fs_st *fs, INODE dir, unsigned int num);
+int fat_readdir_r(struct fs_st *fs, INODE dir, unsigned int num, dirent_t *de, char *name, size_t name_size);
+unsigned int fat_readdirplus(struct fs_st *fs, INODE dir, unsigned int num, direntplus_t *entries, unsigned int count, fs_arena_t *arena);
 int fat_link(struct fs_st *fs, INODE ino, INODE dir, const char *name);
 int fat_unlink(struct fs_st *fs, INODE dir, unsigned int num);
 fstat_t *fat_fstat(struct fs_st *fs, INODE ino);
+int fat_fstat_r(struct fs_st *fs, INODE ino, fstat_t *st);
 int fat_mkdir(struct fs_st *fs, INODE parent, const char *name);
 int fat_rmdir(struct fs_st *fs, INODE dir, unsigned int num);
-void *fat_hook_load(struct fs_st *fs);
-void *fat_hook_create(struct fs_st *fs);
+int fat_fallocate(struct fs_st *fs, INODE ino, uint64_t offset, uint64_t length);
+INODE fat_lookup(struct fs_st *fs, INODE dir, const char *name);
+int fat_open(struct fs_st *fs, fs_file_t *file);
+int fat_map(struct fs_st *fs, INODE ino, fs_extent_t **extents, unsigned int *count);
+void *fat_hook_load(struct fs_st *fs, fs_options_t *opt);
+void *fat_hook_create(struct fs_st *fs, fs_options_t *opt);
 void fat_hook_close(struct fs_st *fs);
 int fat_hook_check(struct fs_st *fs);
+
+fat_data_t *fat_free_data(struct fs_st *fs);
+uint32_t fat_decode_time(uint16_t date, uint16_t time);
+uint16_t fat_encode_date(uint32_t t);
+uint16_t fat_encode_time(uint32_t t);
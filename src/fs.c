@@ -19,6 +19,11 @@ fs_driver_t *supported[] = {
 };
 
 fs_t *fs_load(partition_t *p, fs_type_t type)
+{
+  return fs_load_opt(p, type, 0);
+}
+
+fs_t *fs_load_opt(partition_t *p, fs_type_t type, fs_options_t *opt)
 {
   if(!p)
     return 0;
@@ -33,13 +38,17 @@ fs_t *fs_load(partition_t *p, fs_type_t type)
   fs->data = 0;
   fs->driver = supported[type];
 
+  fs_options_t defaults = {0, 0, 0, 0};
+  if(!opt)
+    opt = &defaults;
+
   if(fs->driver->hook_load)
-    fs->driver->hook_load(fs);
+    fs->driver->hook_load(fs, opt);
 
   return fs;
 }
 
-fs_t *fs_create(partition_t *p, fs_type_t type)
+fs_t *fs_create(partition_t *p, fs_type_t type, fs_options_t *opt)
 {
   if(!p)
     return 0;
@@ -54,8 +63,15 @@ fs_t *fs_create(partition_t *p, fs_type_t type)
   fs->data = 0;
   fs->driver = supported[type];
 
-  if(fs->driver->hook_create)
-    fs->driver->hook_create(fs);
+  fs_options_t defaults = {0, 0, 0, 0};
+  if(!opt)
+    opt = &defaults;
+
+  if(fs->driver->hook_create && !fs->driver->hook_create(fs, opt))
+  {
+    free(fs);
+    return 0;
+  }
 
   return fs;
 }
@@ -79,7 +95,7 @@ int fs_check(fs_t *fs)
   return fs->driver->hook_check(fs);
 }
 
-int fs_read(fs_t *fs, INODE ino, void *buffer, size_t length, size_t offset)
+size_t fs_read(fs_t *fs, INODE ino, void *buffer, size_t length, uint64_t offset)
 {
   if(!fs)
     return 0;
@@ -88,7 +104,7 @@ int fs_read(fs_t *fs, INODE ino, void *buffer, size_t length, size_t offset)
   return fs->driver->read(fs, ino, buffer, length, offset);
 }
 
-int fs_write(fs_t *fs, INODE ino, void *buffer, size_t length, size_t offset)
+size_t fs_write(fs_t *fs, INODE ino, void *buffer, size_t length, uint64_t offset)
 {
   if(!fs)
     return 0;
@@ -103,7 +119,7 @@ INODE fs_touch(fs_t *fs, fstat_t *st)
     return 0;
   if(!fs->driver->touch)
     return 0;
-  return fs->driver->touch(fs, st);
+  return fs->driver->touch(fs, st, 0);
 }
 
 dirent_t *fs_readdir(fs_t *fs, INODE dir, unsigned int num)
@@ -115,6 +131,60 @@ dirent_t *fs_readdir(fs_t *fs, INODE dir, unsigned int num)
   return fs->driver->readdir(fs, dir, num);
 }
 
+int fs_readdir_r(fs_t *fs, INODE dir, unsigned int num, dirent_t *de, char *name, size_t name_size)
+{
+  // Like fs_readdir(), but fills de and copies the name to name, which
+  // de->name is set to. Longer names are cut to name_size - 1 characters.
+  // Returns 1 at the end of the directory.
+  if(!fs)
+    return 1;
+  if(!de)
+    return 1;
+  if(!name || !name_size)
+    return 1;
+  if(fs->driver->readdir_r)
+    return fs->driver->readdir_r(fs, dir, num, de, name, name_size);
+
+  dirent_t *ret = fs_readdir(fs, dir, num);
+  if(!ret)
+    return 1;
+  de->ino = ret->ino;
+  de->name = name;
+  strncpy(name, ret->name, name_size - 1);
+  name[name_size - 1] = '\0';
+  free(ret->name);
+  free(ret);
+  return 0;
+}
+
+unsigned int fs_readdirplus(fs_t *fs, INODE dir, unsigned int num, direntplus_t *entries, unsigned int count, fs_arena_t *arena)
+{
+  // Fills entries with up to count directory entries and their stats,
+  // starting at entry num. Returns the number filled, 0 at the end of
+  // the directory. The names are taken from arena, or allocated and
+  // freed by the caller if arena is 0.
+  if(!fs)
+    return 0;
+  if(!entries)
+    return 0;
+  if(fs->driver->readdirplus)
+    return fs->driver->readdirplus(fs, dir, num, entries, count, arena);
+
+  unsigned int i;
+  char name[FS_NAME_MAX];
+  dirent_t de;
+  for(i = 0; i < count; i++)
+  {
+    if(fs_readdir_r(fs, dir, num + i, &de, name, FS_NAME_MAX))
+      break;
+    entries[i].ino = de.ino;
+    entries[i].name = fs_arena_strndup(arena, name, FS_NAME_MAX);
+    if(fs_fstat_r(fs, entries[i].ino, &entries[i].st))
+      memset(&entries[i].st, 0, sizeof(fstat_t));
+  }
+  return i;
+}
+
 int fs_link(fs_t *fs, INODE ino, INODE dir, const char *name)
 {
   if(!fs)
@@ -142,6 +212,24 @@ fstat_t *fs_fstat(struct fs_st *fs, INODE ino)
   return fs->driver->fstat(fs, ino);
 }
 
+int fs_fstat_r(fs_t *fs, INODE ino, fstat_t *st)
+{
+  // Like fs_fstat(), but fills st
+  if(!fs)
+    return 1;
+  if(!st)
+    return 1;
+  if(fs->driver->fstat_r)
+    return fs->driver->fstat_r(fs, ino, st);
+
+  fstat_t *ret = fs_fstat(fs, ino);
+  if(!ret)
+    return 1;
+  *st = *ret;
+  free(ret);
+  return 0;
+}
+
 int fs_mkdir(struct fs_st *fs, INODE parent, const char *name)
 {
   if(!fs)
@@ -160,32 +248,207 @@ int fs_rmdir(struct fs_st *fs, INODE parent, unsigned int num)
   return 1;
 }
 
+int fs_fallocate(fs_t *fs, INODE ino, uint64_t offset, uint64_t length)
+{
+  // Allocates storage for the given range, growing the file if it ends
+  // past the current size. New space reads back as zeros.
+  if(!fs)
+    return 1;
+  if(length > UINT64_MAX - offset) // The end would wrap around
+    return 1;
+  if(fs->driver->fallocate)
+    return fs->driver->fallocate(fs, ino, offset, length);
+  return 1;
+}
+
+fs_file_t *fs_open(fs_t *fs, INODE ino)
+{
+  if(!fs)
+    return 0;
+  if(!ino)
+    return 0;
+
+  fs_file_t *file = calloc(1, sizeof(fs_file_t));
+  file->fs = fs;
+  file->ino = ino;
+  if(fs->driver->open && fs->driver->open(fs, file))
+  {
+    free(file);
+    return 0;
+  }
+  return file;
+}
+
+size_t fs_pread(fs_file_t *file, void *buffer, size_t length, uint64_t offset)
+{
+  if(!file)
+    return 0;
+  fs_t *fs = file->fs;
+  if(fs->driver->pread)
+    return fs->driver->pread(fs, file, buffer, length, offset);
+  return fs_read(fs, file->ino, buffer, length, offset);
+}
+
+size_t fs_pwrite(fs_file_t *file, void *buffer, size_t length, uint64_t offset)
+{
+  if(!file)
+    return 0;
+  fs_t *fs = file->fs;
+  if(fs->driver->pwrite)
+    return fs->driver->pwrite(fs, file, buffer, length, offset);
+  return fs_write(fs, file->ino, buffer, length, offset);
+}
+
+void fs_close_file(fs_file_t *file)
+{
+  if(!file)
+    return;
+  if(file->fs->driver->close_file)
+    file->fs->driver->close_file(file->fs, file);
+  free(file);
+}
+
+fs_extent_t *fs_fiemap(fs_t *fs, INODE ino, unsigned int *count)
+{
+  // Returns where the data of a file is in the image file, or 0 if the
+  // driver can't tell. The caller frees the array.
+  if(!fs)
+    return 0;
+  if(!count)
+    return 0;
+  if(!fs->driver->map)
+    return 0;
+
+  fs_extent_t *extents = 0;
+  if(fs->driver->map(fs, ino, &extents, count))
+    return 0;
+  uint64_t base = fs->p->offset*BLOCK_SIZE;
+  unsigned int i;
+  for(i = 0; i < *count; i++)
+    extents[i].physical += base;
+  return extents;
+}
+
+uint64_t fs_copy_buffered(fs_t *src_fs, INODE src_ino, fs_t *dst_fs, INODE dst_ino, uint64_t src_offset, uint64_t dst_offset, uint64_t length)
+{
+  // Copy through open files, for drivers that can't map their data
+  fs_file_t *src = fs_open(src_fs, src_ino);
+  fs_file_t *dst = fs_open(dst_fs, dst_ino);
+  uint64_t done = 0;
+  if(src && dst)
+  {
+    char *buffer = malloc(IMAGE_COPY_SIZE);
+    while(done < length)
+    {
+      size_t chunk = length - done < IMAGE_COPY_SIZE ? length - done : IMAGE_COPY_SIZE;
+      size_t count = fs_pread(src, buffer, chunk, src_offset + done);
+      if(!count)
+        break;
+      count = fs_pwrite(dst, buffer, count, dst_offset + done);
+      if(!count)
+        break;
+      done += count;
+    }
+    free(buffer);
+  }
+  fs_close_file(src);
+  fs_close_file(dst);
+  return done;
+}
+
+uint64_t fs_copy_range(fs_t *src_fs, INODE src_ino, fs_t *dst_fs, INODE dst_ino, uint64_t src_offset, uint64_t dst_offset, uint64_t length)
+{
+  // Copies data between two files, which may be in different file
+  // systems and images. The destination must already be large enough,
+  // nothing is allocated. Pieces that are contiguous in both files are
+  // copied directly between the image files. Returns the number of bytes
+  // copied.
+  if(!src_fs)
+    return 0;
+  if(!dst_fs)
+    return 0;
+
+  fstat_t st;
+  if(fs_fstat_r(src_fs, src_ino, &st) || src_offset >= st.size)
+    return 0;
+  if(length > st.size - src_offset)
+    length = st.size - src_offset;
+  if(fs_fstat_r(dst_fs, dst_ino, &st) || dst_offset >= st.size)
+    return 0;
+  if(length > st.size - dst_offset)
+    length = st.size - dst_offset;
+
+  unsigned int src_count = 0, dst_count = 0;
+  fs_extent_t *src_map = fs_fiemap(src_fs, src_ino, &src_count);
+  fs_extent_t *dst_map = fs_fiemap(dst_fs, dst_ino, &dst_count);
+  if(!src_map || !dst_map)
+  {
+    free(src_map);
+    free(dst_map);
+    return fs_copy_buffered(src_fs, src_ino, dst_fs, dst_ino, src_offset, dst_offset, length);
+  }
+
+  uint64_t done = 0;
+  unsigned int s = 0, d = 0;
+  while(done < length)
+  {
+    uint64_t src_pos = src_offset + done;
+    uint64_t dst_pos = dst_offset + done;
+    while(s < src_count && src_map[s].logical + src_map[s].length <= src_pos)
+      s++;
+    while(d < dst_count && dst_map[d].logical + dst_map[d].length <= dst_pos)
+      d++;
+    // Stop at the end of a map or at a hole, the rest is copied below
+    if(s == src_count || src_map[s].logical > src_pos)
+      break;
+    if(d == dst_count || dst_map[d].logical > dst_pos)
+      break;
+
+    uint64_t chunk = length - done;
+    if(chunk > src_map[s].logical + src_map[s].length - src_pos)
+      chunk = src_map[s].logical + src_map[s].length - src_pos;
+    if(chunk > dst_map[d].logical + dst_map[d].length - dst_pos)
+      chunk = dst_map[d].logical + dst_map[d].length - dst_pos;
+
+    if(!image_copybytes(src_fs->p->im, src_map[s].physical + src_pos - src_map[s].logical, \
+          dst_fs->p->im, dst_map[d].physical + dst_pos - dst_map[d].logical, chunk))
+      break;
+    done += chunk;
+  }
+
+  free(src_map);
+  free(dst_map);
+  // Whatever the maps don't cover goes through the drivers
+  if(done < length)
+    done += fs_copy_buffered(src_fs, src_ino, dst_fs, dst_ino, src_offset + done, dst_offset + done, length - done);
+  return done;
+}
+
 INODE fs_finddir(fs_t *fs, INODE dir, const char *name)
 {
   if(!fs)
     return 0;
   if(!dir)
     return 0;
-  if(!fs->driver->readdir)
+  if(!name)
+    return 0;
+  if(fs->driver->lookup)
+    return fs->driver->lookup(fs, dir, name);
+  if(!fs->driver->readdir && !fs->driver->readdir_r)
     return 0;
 
   int num = 0;
-  dirent_t *de;
+  dirent_t de;
+  char buffer[FS_NAME_MAX];
   while(1)
   {
-    de = fs->driver->readdir(fs, dir, num);
-    if(!de)
+    if(fs_readdir_r(fs, dir, num, &de, buffer, FS_NAME_MAX))
       return 0;
-    if(!strcmp(name, de->name))
+    if(!strcmp(name, de.name))
       break;
-    free(de->name);
-    free(de);
     num++;
   }
-  INODE ret = de->ino;
-  free(de->name);
-  free(de);
-  return ret;
+  return de.ino;
 }
 
 INODE fs_find(fs_t *fs, const char *path)
@@ -210,7 +473,10 @@ INODE fs_find(fs_t *fs, const char *path)
 
 INODE fs_touchp(fs_t *fs, fstat_t *st, const char *path)
 {
-  INODE ret = fs_touch(fs, st);
+  if(!fs)
+    return 0;
+  if(!fs->driver->touch)
+    return 0;
   char *dir = strdup(path);
   char *de = strrchr(dir, '/');
   de[0] = '\0';
@@ -220,6 +486,8 @@ INODE fs_touchp(fs_t *fs, fstat_t *st, const char *path)
     free(dir);
     return 0;
   }
+  // Let the driver place the new file near its directory
+  INODE ret = fs->driver->touch(fs, st, dir_ino);
   if(fs_link(fs, ret, dir_ino, &de[1]))
   {
     free(dir);
@@ -228,3 +496,85 @@ INODE fs_touchp(fs_t *fs, fstat_t *st, const char *path)
   free(dir);
   return ret;
 }
+
+void fs_arena_init(fs_arena_t *arena, size_t block_size)
+{
+  if(!arena)
+    return;
+  arena->first = 0;
+  arena->current = 0;
+  arena->block_size = block_size?block_size:4096;
+}
+
+void *fs_arena_alloc(fs_arena_t *arena, size_t size)
+{
+  // Memory from the current block, moving on to the next block or adding
+  // a new one when it is full. Allocations are 8 byte aligned.
+  if(!arena)
+    return malloc(size);
+  size = (size + 7) & ~(size_t)7;
+  fs_arena_block_t *b = arena->current;
+  while(b && b->used + size > b->size)
+  {
+    b = b->next;
+    if(b)
+      b->used = 0;
+  }
+  if(!b)
+  {
+    size_t bs = (size > arena->block_size)?size:arena->block_size;
+    b = malloc(sizeof(fs_arena_block_t) + bs);
+    b->next = 0;
+    b->size = bs;
+    b->used = 0;
+    if(arena->current)
+    {
+      // Keep the unused blocks after the new one
+      b->next = arena->current->next;
+      arena->current->next = b;
+    } else {
+      arena->first = b;
+    }
+  }
+  arena->current = b;
+  void *ret = (char *)(b + 1) + b->used;
+  b->used += size;
+  return ret;
+}
+
+char *fs_arena_strndup(fs_arena_t *arena, const char *s, size_t n)
+{
+  // strndup() from the arena, or from the heap if arena is 0
+  if(!arena)
+    return strndup(s, n);
+  size_t len = strnlen(s, n);
+  char *ret = fs_arena_alloc(arena, len + 1);
+  memcpy(ret, s, len);
+  ret[len] = '\0';
+  return ret;
+}
+
+void fs_arena_reset(fs_arena_t *arena)
+{
+  // Everything allocated from the arena is gone, the blocks are kept
+  if(!arena)
+    return;
+  arena->current = arena->first;
+  if(arena->first)
+    arena->first->used = 0;
+}
+
+void fs_arena_free(fs_arena_t *arena)
+{
+  if(!arena)
+    return;
+  fs_arena_block_t *b = arena->first;
+  while(b)
+  {
+    fs_arena_block_t *next = b->next;
+    free(b);
+    b = next;
+  }
+  arena->first = 0;
+  arena->current = 0;
+}
@@ -10,11 +10,21 @@
 // Needs support from driver:
 // read(ino)
 // write(ino)
-// (ino) = touch()
+// (ino) = touch(dir)
 // (ino, name) = readdir(dir_ino, num)
+// (ino, name, stat)[count] = readdirplus(dir_ino, num, count) (optional,
+//   readdir and fstat are used otherwise)
+// readdir_r(dir_ino, num, de, name), fstat_r(ino, st) (optional, fill
+//   caller buffers instead of allocating)
 // link(ino, dir_ino, name)
 // unlink(dir_ino, num)
 // fstat(ino)
+// fallocate(ino, offset, len)
+// (ino) = lookup(dir_ino, name) (optional, readdir is used otherwise)
+// open(file), pread(file), pwrite(file), close_file(file) (optional,
+//   read and write are used otherwise)
+// (extents) = map(ino) (optional, like fs_fiemap() but physical offsets
+//   are in the partition)
 //
 // Hooks in driver:
 // Load
@@ -23,22 +33,31 @@
 // Check
 
 
-
 typedef struct fs_driver_st
 {
-  int (*read)(fs_t *fs, INODE ino, void *buffer, size_t length, size_t offset);
-  int (*write)(fs_t *fs, INODE ino, void *buffer, size_t length, size_t offset);
-  INODE (*touch)(fs_t *fs, fstat_t *st);
+  size_t (*read)(fs_t *fs, INODE ino, void *buffer, size_t length, uint64_t offset);
+  size_t (*write)(fs_t *fs, INODE ino, void *buffer, size_t length, uint64_t offset);
+  INODE (*touch)(fs_t *fs, fstat_t *st, INODE dir);
   dirent_t *(*readdir)(fs_t *fs, INODE dir, unsigned int num);
+  int (*readdir_r)(fs_t *fs, INODE dir, unsigned int num, dirent_t *de, char *name, size_t name_size);
+  unsigned int (*readdirplus)(fs_t *fs, INODE dir, unsigned int num, direntplus_t *entries, unsigned int count, fs_arena_t *arena);
   int (*link)(fs_t *fs, INODE ino, INODE dir, const char *name);
   int (*unlink)(fs_t *fs, INODE dir, unsigned int num);
   fstat_t *(*fstat)(fs_t *fs, INODE ino);
+  int (*fstat_r)(fs_t *fs, INODE ino, fstat_t *st);
   int (*mkdir)(fs_t *fs, INODE parent, const char *name);
   int (*rmdir)(fs_t *fs, INODE dir, unsigned int num);
+  int (*fallocate)(fs_t *fs, INODE ino, uint64_t offset, uint64_t length);
+  INODE (*lookup)(fs_t *fs, INODE dir, const char *name);
+  int (*open)(fs_t *fs, fs_file_t *file);
+  size_t (*pread)(fs_t *fs, fs_file_t *file, void *buffer, size_t length, uint64_t offset);
+  size_t (*pwrite)(fs_t *fs, fs_file_t *file, void *buffer, size_t length, uint64_t offset);
+  void (*close_file)(fs_t *fs, fs_file_t *file);
+  int (*map)(fs_t *fs, INODE ino, fs_extent_t **extents, unsigned int *count);
   INODE root;
 
-  void *(*hook_load)(fs_t *fs);
-  void *(*hook_create)(fs_t *fs);
+  void *(*hook_load)(fs_t *fs, fs_options_t *opt);
+  void *(*hook_create)(fs_t *fs, fs_options_t *opt);
   void (*hook_close)(fs_t *fs);
   int (*hook_check)(fs_t *fs);
 } fs_driver_t;
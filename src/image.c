@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "image.h"
 #include <dito.h>
 #include <stdio.h>
@@ -5,6 +6,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 CHS_t max_CHS_from_size(size_t size)
 {
@@ -118,8 +120,8 @@ image_t *image_load(char *filename)
       return 0;
     }
 
-    fseek(image->file, 0, SEEK_END);
-    size_t filesize = ftell(image->file);
+    fseeko(image->file, 0, SEEK_END);
+    uint64_t filesize = ftello(image->file);
 
     CHS_t CHS = max_CHS_from_size(filesize);
 
@@ -170,26 +172,26 @@ void image_setmbr(image_t *im, MBR_entry_t *mbr, int num)
   memcpy(&im->mbr[num], mbr, sizeof(MBR_entry_t));
 }
 
-size_t image_get_partition_start(image_t *im, int num)
+uint64_t image_get_partition_start(image_t *im, int num)
 {
   if(num < 0 || num > 3)
     return 0;
   return im->mbr[num].start_LBA;
 }
 
-size_t image_get_partition_length(image_t *im, int num)
+uint64_t image_get_partition_length(image_t *im, int num)
 {
   if(num < 0 || num > 3)
     return 0;
   return im->mbr[num].num_sectors;
 }
 
-size_t image_getsize(image_t *im)
+uint64_t image_getsize(image_t *im)
 {
   if(!im)
     return 0;
 
-  uint32_t blocks = im->cylinders*im->heads*im->sectors;
+  uint64_t blocks = (uint64_t)im->cylinders*im->heads*im->sectors;
 
   return blocks*BLOCK_SIZE;
 }
@@ -223,25 +225,100 @@ int image_check(image_t *im)
   return 0;
 }
 
-int image_readblocks(image_t *im, void *buffer, size_t start, size_t len)
+int image_readblocks(image_t *im, void *buffer, uint64_t start, size_t len)
 {
   if(!im)
     return 0;
 
-  fseek(im->file, start*BLOCK_SIZE, SEEK_SET);
+  fseeko(im->file, (off_t)start*BLOCK_SIZE, SEEK_SET);
   return fread(buffer, len*BLOCK_SIZE, 1, im->file);
 }
 
-int image_writeblocks(image_t *im, void *buffer, size_t start, size_t len)
+int image_writeblocks(image_t *im, void *buffer, uint64_t start, size_t len)
 {
   if (!im)
     return 0;
 
-  fseek(im->file, start*BLOCK_SIZE, SEEK_SET);
+  fseeko(im->file, (off_t)start*BLOCK_SIZE, SEEK_SET);
   return fwrite(buffer, len*BLOCK_SIZE, 1, im->file);
 }
 
-CHS_t CHS_from_LBA(image_t *image, int lba)
+int image_discardblocks(image_t *im, uint64_t start, uint64_t len)
+{
+  // Deallocates the blocks in the image file so that they read back as
+  // zeros. Returns 0 if the host can't punch holes, in which case the
+  // caller has to write zeros itself.
+  if(!im)
+    return 0;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  fflush(im->file);
+  if(fallocate(fileno(im->file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, \
+        (off_t)start*BLOCK_SIZE, (off_t)len*BLOCK_SIZE))
+    return 0;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+int image_copybytes(image_t *src, uint64_t src_offset, image_t *dst, uint64_t dst_offset, uint64_t length)
+{
+  // Copies a byte range between two image files, or within one, without
+  // going through the stdio buffers. Linux can do the copy in the kernel
+  // with copy_file_range(), and may share the data on file systems that
+  // support reflinks. Whatever is left is moved in large chunks.
+  if(!src)
+    return 0;
+  if(!dst)
+    return 0;
+
+  fflush(src->file);
+  fflush(dst->file);
+  int in = fileno(src->file);
+  int out = fileno(dst->file);
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+  while(length)
+  {
+    off64_t off_in = src_offset;
+    off64_t off_out = dst_offset;
+    ssize_t copied = copy_file_range(in, &off_in, out, &off_out, length, 0);
+    // Older kernels refuse copies between file systems, fall back below
+    if(copied <= 0)
+      break;
+    src_offset += copied;
+    dst_offset += copied;
+    length -= copied;
+  }
+#endif
+
+  int ret = 1;
+  if(length)
+  {
+    char *buffer = malloc(IMAGE_COPY_SIZE);
+    while(length)
+    {
+      size_t chunk = length < IMAGE_COPY_SIZE ? length : IMAGE_COPY_SIZE;
+      ssize_t count = pread(in, buffer, chunk, (off_t)src_offset);
+      if(count <= 0 || pwrite(out, buffer, count, (off_t)dst_offset) != count)
+      {
+        ret = 0;
+        break;
+      }
+      src_offset += count;
+      dst_offset += count;
+      length -= count;
+    }
+    free(buffer);
+  }
+
+  // Drop anything stdio has read ahead from the destination, it is stale
+  fflush(dst->file);
+  return ret;
+}
+
+CHS_t CHS_from_LBA(image_t *image, uint32_t lba)
 {
   CHS_t ret;
   ret.C = lba/(image->heads*image->sectors);
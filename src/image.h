@@ -8,6 +8,8 @@
 
 #define BLOCK_SIZE 512
 #define MBR_OFFSET 446
+// Chunk size for copies between image files
+#define IMAGE_COPY_SIZE (1024*1024)
 
 typedef struct
 {
@@ -19,13 +21,15 @@ typedef struct
 
 MBR_entry_t *image_getmbr(image_t *im, int num);
 void image_setmbr(image_t *im, MBR_entry_t *mbr, int num);
-size_t image_getsize(image_t *im);
-size_t image_get_partition_start(image_t *im, int num);
-size_t image_get_partition_length(image_t *im, int num);
+uint64_t image_getsize(image_t *im);
+uint64_t image_get_partition_start(image_t *im, int num);
+uint64_t image_get_partition_length(image_t *im, int num);
 
 int image_check(image_t *im);
-int image_readblocks(image_t *im, void *buffer, size_t start, size_t len);
-int image_writeblocks(image_t *im, void *buffer, size_t start, size_t len);
+int image_readblocks(image_t *im, void *buffer, uint64_t start, size_t len);
+int image_writeblocks(image_t *im, void *buffer, uint64_t start, size_t len);
+int image_discardblocks(image_t *im, uint64_t start, uint64_t len);
+int image_copybytes(image_t *src, uint64_t src_offset, image_t *dst, uint64_t dst_offset, uint64_t length);
 
-CHS_t CHS_from_LBA(image_t *image, int lba);
+CHS_t CHS_from_LBA(image_t *image, uint32_t lba);
 size_t LBA_from_CHS(image_t *image, CHS_t chs);
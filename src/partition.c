@@ -28,7 +28,7 @@ void partition_close(partition_t *p)
   free(p);
 }
 
-size_t partition_readblocks(partition_t *p, void *buffer, size_t start, size_t len)
+size_t partition_readblocks(partition_t *p, void *buffer, uint64_t start, size_t len)
 {
   if(!p)
     return 0;
@@ -37,7 +37,7 @@ size_t partition_readblocks(partition_t *p, void *buffer, size_t start, size_t l
   return image_readblocks(p->im, buffer, start + p->offset, len);
 }
 
-size_t partition_writeblocks(partition_t *p, void *buffer, size_t start, size_t len)
+size_t partition_writeblocks(partition_t *p, void *buffer, uint64_t start, size_t len)
 {
   if(!p)
     return 0;
@@ -45,3 +45,12 @@ size_t partition_writeblocks(partition_t *p, void *buffer, size_t start, size_t
     return 0;
   return image_writeblocks(p->im, buffer, start + p->offset, len);
 }
+
+int partition_discardblocks(partition_t *p, uint64_t start, uint64_t len)
+{
+  if(!p)
+    return 0;
+  if(start + len > p->length)
+    return 0;
+  return image_discardblocks(p->im, start + p->offset, len);
+}
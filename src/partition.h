@@ -6,5 +6,6 @@
 
 #define MBR_OFFSET 446
 
-size_t partition_readblocks(partition_t *p, void *buffer, size_t start, size_t len);
-size_t partition_writeblocks(partition_t *p, void *buffer, size_t start, size_t len);
+size_t partition_readblocks(partition_t *p, void *buffer, uint64_t start, size_t len);
+size_t partition_writeblocks(partition_t *p, void *buffer, uint64_t start, size_t len);
+int partition_discardblocks(partition_t *p, uint64_t start, uint64_t len);
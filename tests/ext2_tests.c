@@ -249,6 +249,82 @@ char *test_ext2_fstat()
   return NULL;
 }
 
+char *test_ext2_placement()
+{
+  size_t sizes[] = {40000000, 0, 0, 0};
+  image_t *im = image_new("tests/testimg2.img", sizes, 0);
+  mu_assert(im, "No image file");
+  partition_t *p = partition_open(im, 0);
+  mu_assert(p, "No partition");
+  fs_t *fs = fs_create(p, ext2, 0);
+  mu_assert(fs, "No file system");
+
+  INODE root = fs_find(fs, "/");
+  fs_mkdir(fs, root, "a");
+  fs_mkdir(fs, root, "b");
+  INODE a = fs_find(fs, "/a");
+  INODE b = fs_find(fs, "/b");
+  mu_assert(a && b, "Directories not created");
+  mu_assert(ext2_inode_group(fs, a) != ext2_inode_group(fs, b), "Top level directories in same group");
+
+  fstat_t st =
+  {
+    1024*2,
+    S_REG | 0777,
+    time(0),
+    time(0),
+    time(0)
+  };
+  INODE i = fs_touchp(fs, &st, "/b/file");
+  mu_assert(i, "No inode after touch");
+  mu_assert(ext2_inode_group(fs, i) == ext2_inode_group(fs, b), "File not in parent's group");
+
+  fs_close(fs);
+  partition_close(p);
+  image_close(im);
+  unlink("tests/testimg2.img");
+  return NULL;
+}
+
+char *test_ext2_fallocate()
+{
+  size_t sizes[] = {40000000, 0, 0, 0};
+  image_t *im = image_new("tests/testimg2.img", sizes, 0);
+  mu_assert(im, "No image file");
+  partition_t *p = partition_open(im, 0);
+  mu_assert(p, "No partition");
+  fs_t *fs = fs_create(p, ext2, 0);
+  mu_assert(fs, "No file system");
+
+  fstat_t st =
+  {
+    100,
+    S_REG | 0777,
+    time(0),
+    time(0),
+    time(0)
+  };
+  INODE i = fs_touchp(fs, &st, "/file");
+  mu_assert(i, "No inode after touch");
+  char *data = malloc(300000);
+  memset(data, 0xAA, 100);
+  mu_assert(fs_write(fs, i, data, 100, 0) == 100, "Write failed");
+  mu_assert(!fs_fallocate(fs, i, 100, 299900), "Fallocate failed");
+
+  fstat_t *ff = fs_fstat(fs, i);
+  mu_assert(ff->size == 300000, "Wrong size after fallocate");
+  free(ff);
+  mu_assert(fs_read(fs, i, data, 300000, 0) == 300000, "Read failed");
+  mu_assert((uint8_t)data[99] == 0xAA, "Old data lost");
+  mu_assert(data[100] == 0 && data[299999] == 0, "New space not zeroed");
+  free(data);
+
+  fs_close(fs);
+  partition_close(p);
+  image_close(im);
+  unlink("tests/testimg2.img");
+  return NULL;
+}
 
 char *all_tests() {
   mu_suite_start();
@@ -259,6 +335,8 @@ char *all_tests() {
   mu_run_test(test_ext2_write);
   mu_run_test(test_ext2_link);
   mu_run_test(test_ext2_fstat);
+  mu_run_test(test_ext2_placement);
+  mu_run_test(test_ext2_fallocate);
   return NULL;
 }
 
@@ -1,6 +1,7 @@
 #include "minunit.h"
 #include <dito.h>
 #include <errno.h>
+#include <unistd.h>
 #include "../src/fat.h"
 
 char *test_fat_load()
@@ -14,7 +15,7 @@ char *test_fat_load()
   mu_assert(fs, "No FAT12");
   mu_assert(fat_bits(fs) == 12, "Wrong FAT type (Not 12)");
   fat_bpb_t *bpb = ((fat_data_t *)fs->data)->bpb;
-  printf("Root cluster: %d\n", ((fat_data_t *)fs->data)->inodes->cluster);
+  printf("Root cluster: %d\n", ((fat_data_t *)fs->data)->inodes[0]->cluster);
   printf(" Bytes per sector: %d\n", bpb->bytes_per_sector);
   printf(" Bytes per cluster: %d (%d sectors)\n", bpb->bytes_per_sector*bpb->sectors_per_cluster, bpb->sectors_per_cluster);
   printf(" Reserved sectors: %d\n", bpb->reserved_sectors);
@@ -34,7 +35,7 @@ char *test_fat_load()
   fs = fs_load(p, fat);
   mu_assert(fs, "No FAT16");
   mu_assert(fat_bits(fs) == 16, "Wrong FAT type (Not 16)");
-  printf("Root cluster: %d\n", ((fat_data_t *)fs->data)->inodes->cluster);
+  printf("Root cluster: %d\n", ((fat_data_t *)fs->data)->inodes[0]->cluster);
   fs_close(fs);
   partition_close(p);
 
@@ -43,7 +44,7 @@ char *test_fat_load()
   fs = fs_load(p, fat);
   mu_assert(fs, "No FAT32");
   mu_assert(fat_bits(fs) == 32, "Wrong FAT type (Not 32)");
-  printf("Root cluster: %d\n", ((fat_data_t *)fs->data)->inodes->cluster);
+  printf("Root cluster: %d\n", ((fat_data_t *)fs->data)->inodes[0]->cluster);
   fs_close(fs);
   partition_close(p);
   image_close(im);
@@ -118,6 +119,84 @@ char *test_fat_longname()
   return NULL;
 }
 
+char *test_fat_time()
+{
+  // 2016-02-29 13:37:42 UTC, FAT times have two second resolution
+  uint32_t t = 1456753062;
+  uint16_t date = fat_encode_date(t);
+  uint16_t time = fat_encode_time(t);
+  mu_assert(date == (((2016 - 1980) << 9) | (2 << 5) | 29), "Wrong FAT date");
+  mu_assert(time == ((13 << 11) | (37 << 5) | 21), "Wrong FAT time");
+  mu_assert(fat_decode_time(date, time) == t, "Wrong time decoded");
+  mu_assert(fat_decode_time((45 << 9) | (12 << 5) | 31, 0) == 1767139200, "Wrong end of year");
+  return NULL;
+}
+
+char *test_fat_create()
+{
+  // Partition sizes that give FAT12, FAT16 and FAT32
+  size_t sizes[3] = {4000000, 64000000, 2200000000};
+  int bits[3] = {12, 16, 32};
+  int i;
+  for(i = 0; i < 3; i++)
+  {
+    size_t s[] = {sizes[i], 0, 0, 0};
+    image_t *im = image_new("tests/fat2.img", s, 0);
+    mu_assert(im, "No image");
+    partition_t *p = partition_open(im, 0);
+    mu_assert(p, "No partition");
+    fs_t *fs = fs_create(p, fat, 0);
+    mu_assert(fs, "No file system");
+    mu_assert(fat_bits(fs) == bits[i], "Wrong FAT type");
+    mu_assert(!fs_mkdir(fs, fs_find(fs, "/"), "dir"), "Mkdir failed");
+    fstat_t st = {10000, S_REG | 0777, 0, 0, 0};
+    INODE ino = fs_touchp(fs, &st, "/dir/file");
+    mu_assert(ino, "Touch failed");
+    char *data = calloc(1, 10000);
+    data[9999] = 'x';
+    mu_assert(fs_write(fs, ino, data, 10000, 0) == 10000, "Write failed");
+    fs_close(fs);
+
+    // Reload reading only one page of the FAT at a time
+    fs_options_t opt = {0, 0, 0, FAT_PAGE_SECTORS};
+    fs = fs_load_opt(p, fat, &opt);
+    ino = fs_find(fs, "/dir/file");
+    mu_assert(ino, "File not found after reload");
+    mu_assert(fs_find(fs, "/DIR/File") == ino, "Lookup is not case insensitive");
+    // Names that share the start get different 8.3 names, and neither
+    // is found by a name that doesn't exist
+    st.size = 0;
+    INODE one = fs_touchp(fs, &st, "/dir/document_one.txt");
+    INODE two = fs_touchp(fs, &st, "/dir/document_two.txt");
+    mu_assert(one && two, "Touch failed");
+    mu_assert(!fs_find(fs, "/dir/document.txt"), "Found a name that doesn't exist");
+    mu_assert(fs_find(fs, "/dir/DOCUMENT_TWO.TXT") == two, "Wrong file found");
+    mu_assert(fs_find(fs, "/dir/docume~2.txt") == two, "8.3 name not found");
+    data[9999] = 0;
+    mu_assert(fs_read(fs, ino, data, 10000, 0) == 10000, "Read failed");
+    mu_assert(data[9999] == 'x', "Wrong data");
+    free(data);
+    mu_assert(!fs_unlink(fs, fs_find(fs, "/dir"), 2), "Unlink failed");
+    mu_assert(!fs_find(fs, "/dir/file"), "File found after unlink");
+    fs_close(fs);
+
+    // The free count in the FAT32 FSInfo must not be left stale
+    fs = fs_load(p, fat);
+    if(bits[i] == 32)
+    {
+      fat_fsinfo_t *info = calloc(1, BLOCK_SIZE);
+      partition_readblocks(p, info, fat_bpb(fs)->fat32.fsinfo_cluster, 1);
+      mu_assert(info->free_count == 0xFFFFFFFF || info->free_count == fat_free_data(fs)->num_free, "Wrong free count in FSInfo");
+      free(info);
+    }
+    fs_close(fs);
+    partition_close(p);
+    image_close(im);
+    unlink("tests/fat2.img");
+  }
+  return NULL;
+}
+
 char *all_tests() {
   mu_suite_start();
   mu_run_test(test_fat_load);
@@ -125,6 +204,8 @@ char *all_tests() {
   mu_run_test(test_fat_write_fat);
   mu_run_test(test_fat_make_shortname);
   mu_run_test(test_fat_longname);
+  mu_run_test(test_fat_time);
+  mu_run_test(test_fat_create);
   return NULL;
 }
 
@@ -3,6 +3,8 @@
 #include "../src/fs.h"
 #include <dito.h>
 #include <unistd.h>
+#include <string.h>
+#include <stdio.h>
 
 char *test_fs_load()
 {
@@ -14,7 +16,7 @@ char *test_fs_find()
   size_t sizes[] = {10000000, 0, 0, 0};
   image_t *im = image_new("tests/testimg2.img", sizes, 0);
   partition_t *p = partition_open(im, 0);
-  fs_t *fs = fs_create(p, ext2);
+  fs_t *fs = fs_create(p, ext2, 0);
 
   INODE i = fs_find(fs, "/");
   mu_assert(i == 2, "Wrong root inode for ext2");
@@ -27,10 +29,310 @@ char *test_fs_find()
   return NULL;
 }
 
+char *test_fs_open()
+{
+  fs_type_t types[2] = {ext2, fat};
+  int t;
+  for(t = 0; t < 2; t++)
+  {
+    size_t sizes[] = {10000000, 0, 0, 0};
+    image_t *im = image_new("tests/testimg2.img", sizes, 0);
+    partition_t *p = partition_open(im, 0);
+    fs_t *fs = fs_create(p, types[t], 0);
+    fstat_t st = {5000, S_REG | 0644, 0, 0, 0};
+    INODE ino = fs_touchp(fs, &st, "/file");
+    mu_assert(ino, "Touch failed");
+
+    fs_file_t *file = fs_open(fs, ino);
+    mu_assert(file, "Open failed");
+    char *data = malloc(10000);
+    int i;
+    for(i = 0; i < 10000; i++)
+      data[i] = i%251;
+    // Write in pieces that don't line up with blocks
+    for(i = 0; i < 5000; i += 700)
+      mu_assert(fs_pwrite(file, &data[i], (i + 700 > 5000)?5000 - i:700, i) > 0, "Write failed");
+    mu_assert(fs_pwrite(file, data, 100, 5000) == 0, "Wrote past end of file");
+
+    // Growing the file is seen by the open file
+    mu_assert(!fs_fallocate(fs, ino, 0, 10000), "Fallocate failed");
+    mu_assert(fs_pwrite(file, &data[5000], 5000, 5000) == 5000, "Write after fallocate failed");
+
+    char *check = calloc(1, 10000);
+    mu_assert(fs_pread(file, check, 10000, 0) == 10000, "Read failed");
+    mu_assert(!memcmp(check, data, 10000), "Wrong data read");
+    fs_close_file(file);
+    memset(check, 0, 10000);
+    mu_assert(fs_read(fs, ino, check, 10000, 0) == 10000, "Read without handle failed");
+    mu_assert(!memcmp(check, data, 10000), "Wrong data read without handle");
+
+    free(data);
+    free(check);
+    fs_close(fs);
+    partition_close(p);
+    image_close(im);
+    unlink("tests/testimg2.img");
+  }
+
+  return NULL;
+}
+
+char *test_fs_fallocate()
+{
+  fs_type_t types[2] = {ext2, fat};
+  int t;
+  for(t = 0; t < 2; t++)
+  {
+    size_t sizes[] = {10000000, 0, 0, 0};
+    image_t *im = image_new("tests/testimg2.img", sizes, 0);
+    partition_t *p = partition_open(im, 0);
+    fs_t *fs = fs_create(p, types[t], 0);
+    INODE root = fs_find(fs, "/");
+    char *data = malloc(200000);
+    memset(data, 0x55, 200000);
+    fstat_t st = {200000, S_REG | 0644, 0, 0, 0};
+    INODE old = fs_touchp(fs, &st, "/old");
+    mu_assert(fs_write(fs, old, data, 200000, 0) == 200000, "Write failed");
+    unsigned int count, k;
+    fs_extent_t *freed = fs_fiemap(fs, old, &count);
+    mu_assert(freed && count, "Fiemap failed");
+    uint64_t first = freed[0].physical;
+    free(freed);
+
+    dirent_t de;
+    char name[FS_NAME_MAX];
+    unsigned int num = 0;
+    while(!fs_readdir_r(fs, root, num, &de, name, sizeof(name)) && strcmp(name, "old"))
+      num++;
+    mu_assert(!fs_unlink(fs, root, num), "Unlink failed");
+
+    // Reload so allocation starts from the beginning of the disk again
+    // instead of after the last allocated cluster
+    fs_close(fs);
+    fs = fs_load(p, types[t]);
+
+    // Space given to a new file must not show what the old one held
+    st.size = 0;
+    INODE ino = fs_touchp(fs, &st, "/new");
+    mu_assert(fs_fallocate(fs, ino, 300000, UINT64_MAX - 1000), "Fallocate past end of range");
+    mu_assert(!fs_fallocate(fs, ino, 0, 200000), "Fallocate failed");
+    fs_extent_t *extents = fs_fiemap(fs, ino, &count);
+    int reused = 0;
+    for(k = 0; k < count; k++)
+      if(first >= extents[k].physical && first < extents[k].physical + extents[k].length)
+        reused = 1;
+    free(extents);
+    mu_assert(reused, "Freed space not reused");
+    mu_assert(fs_read(fs, ino, data, 200000, 0) == 200000, "Read failed");
+    for(k = 0; k < 200000 && !data[k]; k++);
+    mu_assert(k == 200000, "Old data in allocated space");
+
+    free(data);
+    fs_close(fs);
+    partition_close(p);
+    image_close(im);
+    unlink("tests/testimg2.img");
+  }
+
+  return NULL;
+}
+
+char *test_fs_readdirplus()
+{
+  fs_type_t types[2] = {ext2, fat};
+  int t;
+  for(t = 0; t < 2; t++)
+  {
+    size_t sizes[] = {10000000, 0, 0, 0};
+    image_t *im = image_new("tests/testimg2.img", sizes, 0);
+    partition_t *p = partition_open(im, 0);
+    fs_t *fs = fs_create(p, types[t], 0);
+    mu_assert(!fs_mkdir(fs, fs_find(fs, "/"), "dir"), "Mkdir failed");
+    char name[32];
+    int i;
+    for(i = 0; i < 40; i++)
+    {
+      fstat_t st = {i*100, S_REG | 0644, i, i, i};
+      sprintf(name, "/dir/file%d", i);
+      mu_assert(fs_touchp(fs, &st, name), "Touch failed");
+    }
+
+    // Batches must give the same as readdir and fstat
+    INODE dir = fs_find(fs, "/dir");
+    direntplus_t entries[7];
+    unsigned int num = 0, n, k;
+    fs_arena_t arena;
+    fs_arena_init(&arena, 64);
+    while((n = fs_readdirplus(fs, dir, num, entries, 7, t?&arena:0)))
+    {
+      for(k = 0; k < n; k++)
+      {
+        dirent_t *de = fs_readdir(fs, dir, num + k);
+        mu_assert(de, "Too many entries");
+        mu_assert(de->ino == entries[k].ino, "Wrong inode");
+        mu_assert(!strcmp(de->name, entries[k].name), "Wrong name");
+        fstat_t *st = fs_fstat(fs, de->ino);
+        mu_assert(!memcmp(st, &entries[k].st, sizeof(fstat_t)), "Wrong stat");
+        free(st);
+        free(de->name);
+        free(de);
+        if(!t)
+          free(entries[k].name);
+      }
+      num += n;
+      fs_arena_reset(&arena);
+    }
+    mu_assert(num == 42, "Wrong number of entries");
+    fs_arena_free(&arena);
+
+    // The same through caller buffers
+    dirent_t de;
+    char small[4];
+    fstat_t st;
+    mu_assert(!fs_readdir_r(fs, dir, 2, &de, small, sizeof(small)), "Readdir_r failed");
+    mu_assert(de.name == small && strlen(small) == 3, "Name not cut to buffer");
+    mu_assert(!fs_fstat_r(fs, de.ino, &st), "Fstat_r failed");
+    mu_assert((st.mode & S_DIR) != S_DIR, "Wrong mode");
+    mu_assert(fs_readdir_r(fs, dir, 42, &de, small, sizeof(small)), "Read past end");
+
+    fs_close(fs);
+    partition_close(p);
+    image_close(im);
+    unlink("tests/testimg2.img");
+  }
+
+  return NULL;
+}
+
+char *test_fs_fiemap()
+{
+  fs_type_t types[2] = {ext2, fat};
+  int t;
+  for(t = 0; t < 2; t++)
+  {
+    size_t sizes[] = {10000000, 0, 0, 0};
+    image_t *im = image_new("tests/testimg2.img", sizes, 0);
+    partition_t *p = partition_open(im, 0);
+    fs_t *fs = fs_create(p, types[t], 0);
+    char *data = malloc(50000);
+    int i;
+    for(i = 0; i < 50000; i++)
+      data[i] = i%249;
+    fstat_t st = {20000, S_REG | 0644, 0, 0, 0};
+    INODE a = fs_touchp(fs, &st, "/a");
+    INODE b = fs_touchp(fs, &st, "/b");
+    // Grow both files in turns so the data of a is split up
+    mu_assert(!fs_fallocate(fs, b, 0, 30000), "Fallocate failed");
+    mu_assert(!fs_fallocate(fs, a, 0, 50000), "Fallocate failed");
+    mu_assert(fs_write(fs, a, data, 50000, 0) == 50000, "Write failed");
+
+    unsigned int count, k;
+    fs_extent_t *extents = fs_fiemap(fs, a, &count);
+    mu_assert(extents, "Fiemap failed");
+    mu_assert(count > 1, "File is not fragmented");
+    // The data is at the reported places in the image file
+    uint64_t pos = 0;
+    char *check = malloc(50000);
+    for(k = 0; k < count; k++)
+    {
+      mu_assert(extents[k].logical == pos, "Extents not in order");
+      uint64_t len = (pos + extents[k].length > 50000)?50000 - pos:extents[k].length;
+      fseeko(im->file, extents[k].physical, SEEK_SET);
+      mu_assert(fread(&check[pos], len, 1, im->file) == 1, "Read from image failed");
+      pos += extents[k].length;
+    }
+    mu_assert(pos >= 50000, "Extents don't cover the file");
+    mu_assert(!memcmp(check, data, 50000), "Wrong data at extents");
+
+    free(extents);
+    free(check);
+    free(data);
+    fs_close(fs);
+    partition_close(p);
+    image_close(im);
+    unlink("tests/testimg2.img");
+  }
+
+  return NULL;
+}
+
+int (*real_map)(fs_t *fs, INODE ino, fs_extent_t **extents, unsigned int *count);
+
+int short_map(fs_t *fs, INODE ino, fs_extent_t **extents, unsigned int *count)
+{
+  // Only maps the first block, like a block map that ends at a hole
+  if(real_map(fs, ino, extents, count))
+    return 1;
+  if(*count)
+  {
+    *count = 1;
+    (*extents)[0].length = 1024;
+  }
+  return 0;
+}
+
+char *test_fs_copy_range()
+{
+  size_t sizes[] = {10000000, 0, 0, 0};
+  image_t *im = image_new("tests/testimg2.img", sizes, 0);
+  partition_t *p = partition_open(im, 0);
+  fs_t *src = fs_create(p, ext2, 0);
+  image_t *im2 = image_new("tests/testimg3.img", sizes, 0);
+  partition_t *p2 = partition_open(im2, 0);
+  fs_t *dst = fs_create(p2, fat, 0);
+
+  char *data = malloc(100000);
+  int i;
+  for(i = 0; i < 100000; i++)
+    data[i] = i%253;
+  fstat_t st = {100000, S_REG | 0644, 0, 0, 0};
+  INODE from = fs_touchp(src, &st, "/from");
+  mu_assert(fs_write(src, from, data, 100000, 0) == 100000, "Write failed");
+  st.size = 60000;
+  INODE to = fs_touchp(dst, &st, "/to");
+  mu_assert(to, "Touch failed");
+
+  // Offsets that don't line up with blocks or clusters, and a length
+  // that is cut to the destination size
+  mu_assert(fs_copy_range(src, from, dst, to, 1234, 555, 100000) == 60000 - 555, "Wrong length copied");
+  char *check = calloc(1, 60000);
+  mu_assert(fs_read(dst, to, check, 60000, 0) == 60000, "Read failed");
+  mu_assert(!memcmp(&check[555], &data[1234], 60000 - 555), "Wrong data copied");
+  mu_assert(fs_copy_range(src, from, dst, to, 100000, 0, 10) == 0, "Copied past end of file");
+
+  // Data the block maps don't cover goes through the drivers
+  real_map = src->driver->map;
+  src->driver->map = short_map;
+  memset(check, 0, 60000);
+  mu_assert(fs_write(dst, to, check, 60000, 0) == 60000, "Clear failed");
+  mu_assert(fs_copy_range(src, from, dst, to, 0, 0, 100000) == 60000, "Wrong length copied with short map");
+  src->driver->map = real_map;
+  mu_assert(fs_read(dst, to, check, 60000, 0) == 60000, "Read failed");
+  mu_assert(!memcmp(check, data, 60000), "Wrong data copied with short map");
+
+  free(data);
+  free(check);
+  fs_close(src);
+  fs_close(dst);
+  partition_close(p);
+  partition_close(p2);
+  image_close(im);
+  image_close(im2);
+  unlink("tests/testimg2.img");
+  unlink("tests/testimg3.img");
+
+  return NULL;
+}
+
 char *all_tests() {
   mu_suite_start();
   mu_run_test(test_fs_load);
   mu_run_test(test_fs_find);
+  mu_run_test(test_fs_open);
+  mu_run_test(test_fs_fallocate);
+  mu_run_test(test_fs_readdirplus);
+  mu_run_test(test_fs_copy_range);
+  mu_run_test(test_fs_fiemap);
   return NULL;
 }
 
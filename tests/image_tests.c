@@ -73,6 +73,35 @@ char *test_image_readwrite()
   return NULL;
 }
 
+char *test_image_large()
+{
+  char buffer[512];
+  char buffer2[512];
+  memset(buffer2, 0, 512);
+  FILE *fp = fopen("/dev/urandom",  "r");
+  fread(buffer, 512, 1, fp);
+  fclose(fp);
+
+  size_t sizes[] = {5000000000ULL, 0, 0, 0};
+  image_t *im = image_new("tests/testimg2.img", sizes, 0);
+  mu_assert(im != NULL, "Did not return image");
+  mu_assert(image_getsize(im) > 5000000000ULL, "Image size is too small");
+
+  // Past the 4 Gb mark
+  uint64_t block = 9000000;
+  image_writeblocks(im, buffer, block, 1);
+  image_close(im);
+
+  im = image_load("tests/testimg2.img");
+  image_readblocks(im, buffer2, block, 1);
+  mu_assert(!memcmp(buffer, buffer2, 512), "Read beyond 4 Gb did not return same as write");
+
+  image_close(im);
+  unlink("tests/testimg2.img");
+
+  return NULL;
+}
+
 char *test_image_readwrite2()
 {
   char buffer[2048];
@@ -105,6 +134,7 @@ char *all_tests() {
   mu_run_test(test_image_load);
   mu_run_test(test_image_new);
   mu_run_test(test_image_readwrite);
+  mu_run_test(test_image_large);
   mu_run_test(test_image_readwrite2);
   return NULL;
 }
@@ -56,6 +56,35 @@ char *test_partition_write()
   return NULL;
 }
 
+char *test_partition_discard()
+{
+  size_t sizes[] = {10000, 0, 0, 0};
+  image_t *im = image_new("tests/testimg2.img", sizes, 0);
+
+  partition_t *p = partition_open(im, 0);
+
+  char buffer[1024];
+  char zero[1024];
+  memset(zero, 0, 1024);
+  FILE *fp = fopen("/dev/urandom",  "r");
+  fread(buffer, 1024, 1, fp);
+  fclose(fp);
+
+  partition_writeblocks(p, buffer, 4, 2);
+  if(partition_discardblocks(p, 0, p->length))
+  {
+    partition_readblocks(p, buffer, 4, 2);
+    mu_assert(!memcmp(buffer, zero, 1024), "Discarded blocks are not zero");
+  }
+  mu_assert(!partition_discardblocks(p, 1, p->length), "Discarded past end of partition");
+
+  partition_close(p);
+  image_close(im);
+  unlink("tests/testimg2.img");
+
+  return NULL;
+}
+
 char *test_partition_readwrite()
 {
   char buffer[2048];
@@ -92,6 +121,7 @@ char *all_tests() {
 
   mu_run_test(test_partition_read);
   mu_run_test(test_partition_write);
+  mu_run_test(test_partition_discard);
   mu_run_test(test_partition_readwrite);
 
   return NULL;